@@ -1,129 +1,329 @@
-#include <stdio.h>
-#include <string.h>
-#include <search.h>
-#include <unistd.h>
-#include <getopt.h>
-
-#include <readline/readline.h>
-
-#include "lsh_ast.h"
-#include "lsh.yacc.generated_h"
-#include "lsh.lex.generated_h"
-
-#define PROMPT	"$ "
-
-// man 7 environ
-extern char **environ;
-
-int print_ast = 0;
-int print_ast_only = 0;
-
-int handle_script(struct context *context) {
-	if (context->script) {
-		if (print_ast || print_ast_only) {
-			print_script(stdout, context->script, 0);
-		}
-		if (print_ast_only) {
-			return 0;
-		}
-
-		struct run_context run_context = DEFAULT_RUN_CONTEXT;
-		run_script(context, context->script, &run_context);	
-
-		free_script(context->script);
-		context->script = NULL;
-	}
-
-	return 0;
-}
-
-int main(int argc, char **argv)
-{
-	struct context *context = new_context();
-	int rc;
-	FILE *finput = NULL;
-	yyscan_t scanner;
-
-	// Load environment into a data structure. These will work as variables for
-	// variable expansion, for example 'echo $HOME'.
-	for (char **p = environ; p && *p; p++) {
-		const char *buf = strdup(*p);
-		void *t = tsearch(buf, &context->env_tree, env_tree_compare);
-		if (buf != *(const char **)t) free((void*)buf);
-	}
-	//twalk(context->env_tree, tsearch_print_env_tree);
-
-
-	// argument parsing.
-	while (1) {
-		//int this_option_optind = optind ? optind : 1;
-		int c;
-		int option_index = 0;
-		static struct option long_options[] = {
-			{"print_ast",		no_argument,	0, 0 },
-			{"print_ast_only",	no_argument,	0, 0 },
-			{"yydebug",		no_argument,	0, 0 },
-			{0, 0, 0, 0 }
-		};
-
-		c = getopt_long(argc, argv, "",
-				long_options, &option_index);
-		//printf("c is %d option_index %d argc %d argv %p optind %d\n", c, option_index, argc, argv[0], optind);
-		if (c == -1)
-			break;
-
-		switch (c) {
-			case 0:
-				switch (option_index) {
-					case 0:
-						print_ast = 1;
-						break;
-					case 1:
-						print_ast_only = 1;
-						break;
-					case 2:
-						yydebug = 1;
-						break;
-				}
-				break;
-		}
-	}
-
-	yylex_init(&scanner);
-
-	if (argc == optind && isatty(0)) {
-		// If stdin is a terminal, and no arguments are specified, assume an interactive terminal is desired.
-		// Use readline() to provide a pleasant-ish experience.
-		char *input;
-		yylex_init(&scanner);
-		while ((input = readline(PROMPT)) != NULL) {
-			yy_switch_to_buffer(yy_scan_string(input, scanner), scanner);
-			if ((rc = yyparse(context, scanner)) == 0) {
-				rc = handle_script(context);
-			}
-			free(input);
-		}
-	} else {
-		// Read from a script. By default this is stdin.
-		if (argc > optind) {
-			// If a file is specified as a command line argument, read from that instead of stdin.
-			const char *source = argv[optind];
-			finput = fopen(source, "rb");
-			if (finput == NULL) {
-				fprintf(stderr, "Could not open '%s' for reading, errno %d (%s)\n", source, errno, strerror(errno));
-				return 1;
-			}
-			yyset_in(finput, scanner);
-		}
-		// Parse the input file and run the parsed script if parsing was successful.
-		if ((rc = yyparse(context, scanner)) == 0) {
-			rc = handle_script(context);
-		}
-	}
-	// Cleanup.
-	yylex_destroy(scanner);
-	if (finput) fclose(finput);
-	free_context(context);
-	return rc;
-}
-
+#include <stdio.h>
+#include <string.h>
+#include <search.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include <readline/readline.h>
+
+#include "lsh_ast.h"
+#include "lsh.yacc.generated_h"
+#include "lsh.lex.generated_h"
+
+#define PROMPT	"$ "
+
+// man 7 environ
+extern char **environ;
+
+int print_ast = 0;
+int print_ast_only = 0;
+int print_bytecode_flag = 0;
+
+// Parse a script with 'scanner'. On a syntax error the parser frees what it
+// had built (see the %destructor declarations in lsh.yacc), so only a script
+// that parsed is left in context->script.
+static int parse(struct context *context, yyscan_t scanner) {
+	int rc = yyparse(context, scanner);
+	if (rc != 0)
+		context->script = NULL;
+	return rc;
+}
+
+static void scanner_init(struct lex_state *lex_state, yyscan_t *scanner) {
+	yylex_init_extra(lex_state, scanner);
+	memstat_add(MEMSTAT_SCANNER, 1);
+}
+
+static void scanner_destroy(yyscan_t scanner) {
+	yylex_destroy(scanner);
+	memstat_add(MEMSTAT_SCANNER, -1);
+}
+
+// Print and/or run the parsed script. Returns the return code of the script.
+int handle_script(struct context *context) {
+	int rc = 0;
+
+	if (context->script) {
+		if (print_ast || print_ast_only) {
+			print_script(stdout, context->script, 0);
+		}
+		// --print_ast_only still frees the script, so that an interactive session doesn't leak it.
+		if (!print_ast_only) {
+			if (print_bytecode_flag) {
+				print_bytecode(stdout, context, context->script);
+			}
+			struct run_context run_context = DEFAULT_RUN_CONTEXT;
+			rc = run_script(context, context->script, &run_context);
+		}
+
+		free_script(context->script);
+		context->script = NULL;
+	}
+
+	return rc;
+}
+
+// Load environment into a data structure. These will work as variables for
+// variable expansion, for example 'echo $HOME'.
+static void load_environ(struct context *context) {
+	for (char **p = environ; p && *p; p++) {
+		const char *buf = strdup(*p);
+		void *t = tsearch(buf, &context->env_tree, env_tree_compare);
+		if (buf != *(const char **)t) free((void*)buf);
+		else memstat_add(MEMSTAT_ENV, 1);
+	}
+	//twalk(context->env_tree, tsearch_print_env_tree);
+}
+
+/*
+ * lsh -j N a.sh b.sh ...: run independent scripts in parallel, each with its
+ * own context. The scripts are parsed by up to N threads, each with its own
+ * scanner, then run in up to N child processes at a time (a process each, as
+ * 'cd' and file descriptors are per process). Each script's return code is
+ * reported on stderr once all have finished.
+ */
+
+struct script_job {
+	const char *path;
+	struct context *context;
+	int opened;
+	int parse_rc;
+	pid_t pid;
+	int rc;
+};
+
+struct parse_pool {
+	struct script_job *jobs;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void parse_script_job(struct script_job *job) {
+	struct lex_state lex_state = LEX_STATE_INIT;
+	yyscan_t scanner;
+
+	FILE *finput = fopen(job->path, "rb");
+	if (finput == NULL) {
+		fprintf(stderr, "Could not open '%s' for reading, errno %d (%s)\n", job->path, errno, strerror(errno));
+		job->parse_rc = 1;
+		return;
+	}
+	job->opened = 1;
+	scanner_init(&lex_state, &scanner);
+	yyset_in(finput, scanner);
+	job->parse_rc = parse(job->context, scanner);
+	scanner_destroy(scanner);
+	fclose(finput);
+}
+
+static void *parse_worker(void *arg) {
+	struct parse_pool *pool = arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		int i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->n)
+			return NULL;
+		parse_script_job(&pool->jobs[i]);
+	}
+}
+
+// Returns the first non-zero return code, in argument order, or 0.
+static int run_scripts_parallel(int max_jobs, char **paths, int n) {
+	struct script_job *jobs = calloc(n, sizeof(*jobs));
+	for (int i = 0; i < n; i++) {
+		jobs[i].path = paths[i];
+		jobs[i].context = new_context();
+		load_environ(jobs[i].context);
+	}
+
+	struct parse_pool pool = { .jobs = jobs, .n = n, .next = 0 };
+	int nthreads = max_jobs < n ? max_jobs : n;
+	pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+	pthread_mutex_init(&pool.lock, NULL);
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, parse_worker, &pool) != 0) {
+			fprintf(stderr, "[lsh.c -> run_scripts_parallel()] pthread_create error\n");
+			nthreads = i;
+			break;
+		}
+	}
+	// If no thread could be started, parse here.
+	if (nthreads == 0)
+		parse_worker(&pool);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+
+	int next = 0;
+	int running = 0;
+	fflush(stdout);
+	while (next < n || running > 0) {
+		if (next < n && running < max_jobs) {
+			struct script_job *job = &jobs[next++];
+			if (job->parse_rc != 0)
+				continue;
+			job->pid = fork();
+			if (job->pid == 0) {
+				exit(handle_script(job->context));
+			} else if (job->pid < 0) {
+				printf("[lsh.c -> run_scripts_parallel()] fork error: %d\n", errno);
+				job->rc = EAGAIN;
+			} else {
+				running++;
+			}
+			// The child has its own copy; the parent is done with the script.
+			free_script(job->context->script);
+			job->context->script = NULL;
+			continue;
+		}
+
+		int wstatus;
+		pid_t pid = wait(&wstatus);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("[lsh.c -> run_scripts_parallel()] wait error: %d\n", errno);
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (jobs[i].pid == pid) {
+				jobs[i].rc = wait_status_to_rc(wstatus);
+				running--;
+			}
+		}
+	}
+
+	int rc = 0;
+	for (int i = 0; i < n; i++) {
+		if (!jobs[i].opened)
+			fprintf(stderr, "%s: cannot open\n", jobs[i].path);
+		else if (jobs[i].parse_rc != 0)
+			fprintf(stderr, "%s: parse error\n", jobs[i].path);
+		else
+			fprintf(stderr, "%s: exit %d\n", jobs[i].path, jobs[i].rc);
+		if (rc == 0)
+			rc = jobs[i].parse_rc != 0 ? jobs[i].parse_rc : jobs[i].rc;
+		if (jobs[i].context->script)
+			free_script(jobs[i].context->script);
+		free_context(jobs[i].context);
+	}
+	free(jobs);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct context *context = new_context();
+	int rc;
+	int max_jobs = 0;
+	FILE *finput = NULL;
+	yyscan_t scanner;
+	struct lex_state lex_state = LEX_STATE_INIT;
+
+	load_environ(context);
+
+	// argument parsing.
+	while (1) {
+		//int this_option_optind = optind ? optind : 1;
+		int c;
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"print_ast",		no_argument,	0, 0 },
+			{"print_ast_only",	no_argument,	0, 0 },
+			{"yydebug",		no_argument,	0, 0 },
+			{"print_bytecode",	no_argument,	0, 0 },
+			{0, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "j:",
+				long_options, &option_index);
+		//printf("c is %d option_index %d argc %d argv %p optind %d\n", c, option_index, argc, argv[0], optind);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 0:
+				switch (option_index) {
+					case 0:
+						print_ast = 1;
+						break;
+					case 1:
+						print_ast_only = 1;
+						break;
+					case 2:
+						yydebug = 1;
+						break;
+					case 3:
+						print_bytecode_flag = 1;
+						break;
+				}
+				break;
+			case 'j':
+				max_jobs = atoi(optarg);
+				if (max_jobs < 1) {
+					fprintf(stderr, "lsh: -j needs a positive number of jobs\n");
+					return 1;
+				}
+				break;
+		}
+	}
+
+	if (max_jobs > 0) {
+		if (argc == optind) {
+			fprintf(stderr, "usage: lsh -j N script...\n");
+			return 1;
+		}
+		free_context(context);
+		return run_scripts_parallel(max_jobs, &argv[optind], argc - optind);
+	}
+
+	scanner_init(&lex_state, &scanner);
+
+	if (argc == optind && isatty(0)) {
+		// If stdin is a terminal, and no arguments are specified, assume an interactive terminal is desired.
+		// Use readline() to provide a pleasant-ish experience. The one scanner is reused for every line,
+		// each line's buffer being deleted once it is parsed, so a long session runs in constant memory.
+		char *input;
+		while ((input = readline(PROMPT)) != NULL) {
+			// Each line is parsed from scratch, so keywords are recognized at its start.
+			lex_state = (struct lex_state)LEX_STATE_INIT;
+			YY_BUFFER_STATE line = yy_scan_string(input, scanner);
+			memstat_add(MEMSTAT_SCANNER, 1);
+			if ((rc = parse(context, scanner)) == 0) {
+				rc = handle_script(context);
+			}
+			yy_delete_buffer(line, scanner);
+			memstat_add(MEMSTAT_SCANNER, -1);
+			free(input);
+		}
+	} else {
+		// Read from a script. By default this is stdin.
+		if (argc > optind) {
+			// If a file is specified as a command line argument, read from that instead of stdin.
+			const char *source = argv[optind];
+			finput = fopen(source, "rb");
+			if (finput == NULL) {
+				fprintf(stderr, "Could not open '%s' for reading, errno %d (%s)\n", source, errno, strerror(errno));
+				return 1;
+			}
+			yyset_in(finput, scanner);
+		}
+		// Parse the input file and run the parsed script if parsing was successful.
+		if ((rc = parse(context, scanner)) == 0) {
+			rc = handle_script(context);
+		}
+	}
+	// Cleanup.
+	scanner_destroy(scanner);
+	if (finput) fclose(finput);
+	free_context(context);
+	return rc;
+}
+
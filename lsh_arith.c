@@ -0,0 +1,387 @@
+// Arithmetic expansion: '$((expr))' words.
+//
+// Expressions use 64-bit signed integers, wrapping on overflow, with C's
+// operators and precedence:
+//
+//   ( )   unary + - ~ !   * / %   + -   << >>   < <= > >=   == !=   &   ^   |
+//
+// Operands are decimal, 0x hex or 0 octal numbers, and variables, written
+// '$NAME' or just 'NAME'. A variable that is unset or empty is 0; any other
+// value must be a number.
+//
+// An expression is parsed once, with the shunting-yard algorithm, into a
+// postfix program cached on its word (struct word's arith), so a loop body
+// evaluates it without parsing it again. Variables are looked up on each
+// evaluation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "lsh_ast.h"
+
+enum arith_op {
+	A_NUM,
+	A_VAR,
+	A_NEG,
+	A_NOT,		// ~
+	A_LNOT,		// !
+	A_MUL,
+	A_DIV,
+	A_MOD,
+	A_ADD,
+	A_SUB,
+	A_SHL,
+	A_SHR,
+	A_LT,
+	A_LE,
+	A_GT,
+	A_GE,
+	A_EQ,
+	A_NE,
+	A_AND,
+	A_XOR,
+	A_OR,
+	// Only on the parser's operator stack.
+	A_LPAREN,
+	A_UPLUS,
+};
+
+struct arith_insn {
+	enum arith_op op;
+	int64_t value;
+	char *name;
+};
+
+struct arith_expr {
+	struct arith_insn *code;
+	int n;
+	// The evaluation stack it needs.
+	int depth;
+	// Why the expression doesn't parse; NULL if it does.
+	const char *error;
+};
+
+static const struct {
+	const char *text;
+	enum arith_op op;
+	int precedence;
+} binary_ops[] = {
+	// Two character operators first, so that '<<' isn't read as '<'.
+	{ "<<", A_SHL, 9 }, { ">>", A_SHR, 9 }, { "<=", A_LE, 8 }, { ">=", A_GE, 8 },
+	{ "==", A_EQ, 7 }, { "!=", A_NE, 7 },
+	{ "*", A_MUL, 11 }, { "/", A_DIV, 11 }, { "%", A_MOD, 11 },
+	{ "+", A_ADD, 10 }, { "-", A_SUB, 10 },
+	{ "<", A_LT, 8 }, { ">", A_GT, 8 },
+	{ "&", A_AND, 6 }, { "^", A_XOR, 5 }, { "|", A_OR, 4 },
+};
+
+#define UNARY_PRECEDENCE	12
+
+struct arith_parser {
+	struct arith_expr *expr;
+	int capacity;
+	int depth;
+	// Pending operators, with their precedence.
+	enum arith_op *ops;
+	int *precedences;
+	int nops;
+};
+
+static void emit(struct arith_parser *p, enum arith_op op, int64_t value, char *name) {
+	struct arith_expr *expr = p->expr;
+	if (expr->n == p->capacity) {
+		p->capacity = p->capacity ? p->capacity << 1 : 8;
+		expr->code = realloc(expr->code, sizeof(*expr->code) * p->capacity);
+		CHECK(expr->code != NULL);
+	}
+	expr->code[expr->n].op = op;
+	expr->code[expr->n].value = value;
+	expr->code[expr->n].name = name;
+	expr->n++;
+
+	// Operands push a value and binary operators pop one.
+	if (op == A_NUM || op == A_VAR)
+		p->depth++;
+	else if (op >= A_MUL)
+		p->depth--;
+	if (p->depth > expr->depth)
+		expr->depth = p->depth;
+}
+
+static void push_op(struct arith_parser *p, enum arith_op op, int precedence) {
+	p->ops[p->nops] = op;
+	p->precedences[p->nops] = precedence;
+	p->nops++;
+}
+
+// Move pending operators that bind at least as tightly as 'precedence' to the
+// output, stopping at an open parenthesis.
+static void pop_ops(struct arith_parser *p, int precedence) {
+	while (p->nops > 0 && p->ops[p->nops - 1] != A_LPAREN && p->precedences[p->nops - 1] >= precedence) {
+		enum arith_op op = p->ops[--p->nops];
+		if (op != A_UPLUS)
+			emit(p, op, 0, NULL);
+	}
+}
+
+// Read a number the way C writes it (0x hex, 0 octal), wrapping to 64 bits.
+// Returns the end of the number, or NULL if 's' doesn't hold one.
+static const char *parse_number(const char *s, int64_t *value) {
+	uint64_t v = 0;
+	int base = 10;
+
+	if (!isdigit((unsigned char)*s))
+		return NULL;
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		base = 16;
+		s += 2;
+		if (!isxdigit((unsigned char)*s))
+			return NULL;
+	} else if (s[0] == '0') {
+		base = 8;
+	}
+	for (;; s++) {
+		int digit;
+		if (isdigit((unsigned char)*s))
+			digit = *s - '0';
+		else if (isxdigit((unsigned char)*s))
+			digit = tolower((unsigned char)*s) - 'a' + 10;
+		else
+			break;
+		if (digit >= base)
+			return NULL;
+		v = v * base + digit;
+	}
+	if (isalnum((unsigned char)*s) || *s == '_')
+		return NULL;
+	*value = (int64_t)v;
+	return s;
+}
+
+static int is_name_start(char c) {
+	return isalpha((unsigned char)c) || c == '_';
+}
+
+static int is_name_char(char c) {
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+// Parse 'text' into a postfix program. On a syntax error, the returned
+// expression's 'error' says why.
+static struct arith_expr *arith_parse(const char *text) {
+	struct arith_parser p = { 0 };
+	size_t len = strlen(text);
+	const char *s = text;
+	// Whether the next token is an operand (or a unary operator or '(').
+	int want_operand = 1;
+
+	p.expr = calloc(1, sizeof(*p.expr));
+	p.ops = malloc(sizeof(*p.ops) * (len + 1));
+	p.precedences = malloc(sizeof(*p.precedences) * (len + 1));
+	CHECK(p.expr != NULL && p.ops != NULL && p.precedences != NULL);
+
+	for (;;) {
+		while (isspace((unsigned char)*s))
+			s++;
+		if (*s == 0)
+			break;
+
+		if (want_operand) {
+			int64_t value;
+			const char *end;
+			if (*s == '(') {
+				push_op(&p, A_LPAREN, 0);
+				s++;
+			} else if (*s == '-' || *s == '+' || *s == '~' || *s == '!') {
+				push_op(&p, *s == '-' ? A_NEG : *s == '+' ? A_UPLUS : *s == '~' ? A_NOT : A_LNOT, UNARY_PRECEDENCE);
+				s++;
+			} else if ((end = parse_number(s, &value)) != NULL) {
+				emit(&p, A_NUM, value, NULL);
+				s = end;
+				want_operand = 0;
+			} else if (is_name_start(s[*s == '$'])) {
+				if (*s == '$')
+					s++;
+				end = s;
+				while (is_name_char(*end))
+					end++;
+				emit(&p, A_VAR, 0, strndup(s, end - s));
+				s = end;
+				want_operand = 0;
+			} else {
+				p.expr->error = isdigit((unsigned char)*s) ? "bad number" : "operand expected";
+				goto out;
+			}
+			continue;
+		}
+
+		if (*s == ')') {
+			pop_ops(&p, 0);
+			if (p.nops == 0) {
+				p.expr->error = "unbalanced ')'";
+				goto out;
+			}
+			p.nops--;
+			s++;
+			continue;
+		}
+		size_t i;
+		for (i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++) {
+			if (strncmp(s, binary_ops[i].text, strlen(binary_ops[i].text)) == 0)
+				break;
+		}
+		if (i == sizeof(binary_ops) / sizeof(binary_ops[0])) {
+			p.expr->error = "operator expected";
+			goto out;
+		}
+		pop_ops(&p, binary_ops[i].precedence);
+		push_op(&p, binary_ops[i].op, binary_ops[i].precedence);
+		s += strlen(binary_ops[i].text);
+		want_operand = 1;
+	}
+
+	// '$(( ))' is 0.
+	if (want_operand && p.expr->n == 0 && p.nops == 0) {
+		emit(&p, A_NUM, 0, NULL);
+		want_operand = 0;
+	}
+	if (want_operand) {
+		p.expr->error = "operand expected";
+		goto out;
+	}
+	pop_ops(&p, 0);
+	if (p.nops > 0)
+		p.expr->error = "missing ')'";
+
+out:
+	free(p.ops);
+	free(p.precedences);
+	return p.expr;
+}
+
+void free_arith(struct arith_expr *expr) {
+	if (expr == NULL)
+		return;
+	for (int i = 0; i < expr->n; i++)
+		free(expr->code[i].name);
+	free(expr->code);
+	free(expr);
+}
+
+// A variable's value as a number: unset or empty is 0.
+static int var_value(const struct context *context, const char *name, int64_t *value) {
+	const char *s = context_get_var(context, name);
+	int negative = 0;
+
+	*value = 0;
+	if (s == NULL)
+		return 0;
+	while (isspace((unsigned char)*s))
+		s++;
+	if (*s == 0)
+		return 0;
+	if (*s == '-' || *s == '+')
+		negative = *s++ == '-';
+	const char *end = parse_number(s, value);
+	if (end == NULL)
+		return -1;
+	while (isspace((unsigned char)*end))
+		end++;
+	if (*end != 0)
+		return -1;
+	if (negative)
+		*value = (int64_t)(0 - (uint64_t)*value);
+	return 0;
+}
+
+static void arith_error(const char *text, const char *error, const char *detail) {
+	fprintf(stderr, "lsh: $((%s)): %s%s%s\n", text, detail ? detail : "", detail ? ": " : "", error);
+}
+
+// Evaluate the $((...)) word 'word', parsing it on first use. Returns 0 and
+// sets '*result', or prints why it can't and returns -1.
+int arith_eval(const struct context *context, const struct word *word, int64_t *result) {
+	if (word->arith == NULL)
+		((struct word *)word)->arith = arith_parse(word->text);
+	const struct arith_expr *expr = word->arith;
+	if (expr->error) {
+		arith_error(word->text, expr->error, NULL);
+		return -1;
+	}
+
+	int64_t small[16];
+	int64_t *stack = expr->depth <= 16 ? small : malloc(sizeof(*stack) * expr->depth);
+	int sp = 0;
+	int rc = 0;
+
+	for (int i = 0; i < expr->n; i++) {
+		const struct arith_insn *insn = &expr->code[i];
+		if (insn->op == A_NUM) {
+			stack[sp++] = insn->value;
+			continue;
+		}
+		if (insn->op == A_VAR) {
+			if (var_value(context, insn->name, &stack[sp++]) != 0) {
+				arith_error(word->text, "not a number", insn->name);
+				rc = -1;
+				break;
+			}
+			continue;
+		}
+
+		int64_t b = stack[sp - 1];
+		switch (insn->op) {
+			case A_NEG: stack[sp - 1] = (int64_t)(0 - (uint64_t)b); continue;
+			case A_NOT: stack[sp - 1] = ~b; continue;
+			case A_LNOT: stack[sp - 1] = !b; continue;
+			default: break;
+		}
+
+		int64_t a = stack[sp - 2];
+		int64_t v = 0;
+		sp--;
+		switch (insn->op) {
+			case A_DIV:
+			case A_MOD:
+				if (b == 0) {
+					arith_error(word->text, "division by 0", NULL);
+					rc = -1;
+					break;
+				}
+				// INT64_MIN / -1 overflows; it wraps, like the other operators.
+				if (b == -1)
+					v = insn->op == A_DIV ? (int64_t)(0 - (uint64_t)a) : 0;
+				else
+					v = insn->op == A_DIV ? a / b : a % b;
+				break;
+			case A_MUL: v = (int64_t)((uint64_t)a * (uint64_t)b); break;
+			case A_ADD: v = (int64_t)((uint64_t)a + (uint64_t)b); break;
+			case A_SUB: v = (int64_t)((uint64_t)a - (uint64_t)b); break;
+			case A_SHL: v = (int64_t)((uint64_t)a << (b & 63)); break;
+			case A_SHR: v = a >> (b & 63); break;
+			case A_LT: v = a < b; break;
+			case A_LE: v = a <= b; break;
+			case A_GT: v = a > b; break;
+			case A_GE: v = a >= b; break;
+			case A_EQ: v = a == b; break;
+			case A_NE: v = a != b; break;
+			case A_AND: v = a & b; break;
+			case A_XOR: v = a ^ b; break;
+			case A_OR: v = a | b; break;
+			default: CHECK(!"unexpected arithmetic op"); break;
+		}
+		if (rc != 0)
+			break;
+		stack[sp - 1] = v;
+	}
+
+	if (rc == 0)
+		*result = stack[0];
+	if (stack != small)
+		free(stack);
+	return rc;
+}
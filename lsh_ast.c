@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <search.h>
 #include <ctype.h>
 #include <inttypes.h>
@@ -14,8 +15,6 @@
 #include "lsh_ast.h"
 
 // Forward declarations.
-/*static*/ void context_pid_wait_tree_add(struct context *context, int pid);
-/*static*/ void context_empty_pid_wait_tree(struct context *context);
 
 int errno;
 
@@ -38,14 +37,6 @@ int env_tree_compare(const void *a, const void *b) {
 	return rc;
 }
 
-int pid_wait_tree_compare(const void *a, const void *b) {
-	uintptr_t ap = (uintptr_t)a;
-	uintptr_t bp = (uintptr_t)b;
-	if (ap < bp) return -1;
-	else if (ap == bp) return 0;
-	else return -1;
-}
-
 void tsearch_print_env_tree(const void *nodep, VISIT which, int depth)
 {
 	const char *datap;
@@ -57,6 +48,63 @@ void tsearch_print_env_tree(const void *nodep, VISIT which, int depth)
 }
 
 
+// The AST is walked with an explicit stack of pending nodes rather than by
+// recursion, so that printing and freeing deeply nested scripts and very long
+// &&, || and | chains is bounded by heap memory rather than the C stack.
+struct ast_task {
+	int kind;
+	int depth;
+	const void *node;
+	const void *aux;
+};
+
+struct ast_stack {
+	struct ast_task *tasks;
+	size_t n;
+	size_t capacity;
+};
+
+static void ast_push(struct ast_stack *stack, int kind, const void *node, const void *aux, int depth) {
+	if (node == NULL)
+		return;
+	if (stack->n == stack->capacity) {
+		stack->capacity = stack->capacity ? stack->capacity << 1 : 32;
+		stack->tasks = realloc(stack->tasks, sizeof(*stack->tasks) * stack->capacity);
+		CHECK(stack->tasks != NULL);
+	}
+	struct ast_task *t = &stack->tasks[stack->n++];
+	t->kind = kind;
+	t->node = node;
+	t->aux = aux;
+	t->depth = depth;
+}
+
+static int ast_pop(struct ast_stack *stack, struct ast_task *task) {
+	if (stack->n == 0) {
+		free(stack->tasks);
+		stack->tasks = NULL;
+		stack->capacity = 0;
+		return 0;
+	}
+	*task = stack->tasks[--stack->n];
+	return 1;
+}
+
+enum ast_kind {
+	AST_SCRIPT,
+	AST_STATEMENT,
+	AST_STATEMENT_LIST,	// node is the next statement of a script to print
+	AST_PROGRAM,
+	AST_CONDITIONAL,
+	AST_CONDITIONAL_PART,	// aux is the conditional, for its else block
+	AST_THEN,
+	AST_ELSE,
+	AST_FOR_LOOP,
+	AST_WHILE_LOOP,
+	AST_DO,
+	AST_VAR_ASSIGN,
+};
+
 void space(FILE *f, int depth) {
 	for (int i = 0; i < depth; i++)
 		fprintf(f, "  ");
@@ -64,163 +112,325 @@ void space(FILE *f, int depth) {
 
 void print_words(FILE *f, const struct words *words) {
 	int i = 0;
-	for (const struct word *w = words->first; w != NULL; w = w->next) {
-		fprintf(f, "%s%s", i++ ? " " : "", w->text);
+	for (const struct word *w = words ? words->first : NULL; w != NULL; w = w->next) {
+		if (w->is_arith)
+			fprintf(f, "%s$((%s))", i++ ? " " : "", w->text);
+		else if (w->is_range)
+			fprintf(f, "%s{%s}", i++ ? " " : "", w->text);
+		else
+			fprintf(f, "%s%s", i++ ? " " : "", w->text);
+	}
+}
+
+static void print_ast(FILE *f, int kind, const void *node, int depth) {
+	struct ast_stack stack = { 0 };
+	struct ast_task t;
+
+	ast_push(&stack, kind, node, NULL, depth);
+	while (ast_pop(&stack, &t)) {
+		switch (t.kind) {
+			case AST_SCRIPT: {
+				const struct script *script = t.node;
+				space(f, t.depth);
+				fprintf(f, "script:\n");
+				ast_push(&stack, AST_STATEMENT_LIST, script->first, NULL, t.depth + 1);
+				break;
+			}
+			case AST_STATEMENT_LIST: {
+				const struct statement *statement = t.node;
+				ast_push(&stack, AST_STATEMENT_LIST, statement->next, NULL, t.depth);
+				ast_push(&stack, AST_STATEMENT, statement, NULL, t.depth);
+				break;
+			}
+			case AST_STATEMENT: {
+				const struct statement *statement = t.node;
+				int d = t.depth;
+				if (statement->timed) {
+					space(f, d);
+					fprintf(f, "time:\n");
+					d++;
+				}
+				ast_push(&stack, AST_VAR_ASSIGN, statement->var_assign, NULL, d);
+				ast_push(&stack, AST_PROGRAM, statement->program, NULL, d);
+				ast_push(&stack, AST_CONDITIONAL, statement->conditional, NULL, d);
+				ast_push(&stack, AST_WHILE_LOOP, statement->while_loop, NULL, d);
+				ast_push(&stack, AST_FOR_LOOP, statement->for_loop, NULL, d);
+				break;
+			}
+			case AST_PROGRAM: {
+				const struct program *program = t.node;
+				const char *header = NULL;
+				if (program->print_fn == print_or_programs)
+					header = "or || programs:";
+				else if (program->print_fn == print_and_programs)
+					header = "and && programs:";
+				else if (program->print_fn == print_pipe_programs)
+					header = "pipe | programs:";
+
+				if (header) {
+					space(f, t.depth);
+					fprintf(f, "%s\n", header);
+					ast_push(&stack, AST_PROGRAM, program->rhs, NULL, t.depth + 1);
+					ast_push(&stack, AST_PROGRAM, program->lhs, NULL, t.depth + 1);
+				} else if (program->print_fn == print_fanout_program) {
+					space(f, t.depth);
+					fprintf(f, "fan-out |& branches:\n");
+					ast_push(&stack, AST_SCRIPT, program->script, NULL, t.depth + 1);
+				} else if (program->print_fn) {
+					program->print_fn(f, program, t.depth);
+				} else if (program->script) {
+					ast_push(&stack, AST_SCRIPT, program->script, NULL, t.depth);
+				} else {
+					space(f, t.depth);
+					fprintf(f, "program: ");
+					print_words(f, program->words);
+					fprintf(f, "\n");
+				}
+				break;
+			}
+			case AST_CONDITIONAL: {
+				const struct conditional *conditional = t.node;
+				if (conditional->first)
+					ast_push(&stack, AST_CONDITIONAL_PART, conditional->first, conditional, t.depth);
+				else
+					ast_push(&stack, AST_ELSE, conditional, NULL, t.depth);
+				break;
+			}
+			case AST_CONDITIONAL_PART: {
+				const struct conditional_part *cp = t.node;
+				const struct conditional *conditional = t.aux;
+				space(f, t.depth);
+				fprintf(f, "%sif:\n", cp == conditional->first ? "" : "el");
+				if (cp->next)
+					ast_push(&stack, AST_CONDITIONAL_PART, cp->next, conditional, t.depth);
+				else
+					ast_push(&stack, AST_ELSE, conditional, NULL, t.depth);
+				ast_push(&stack, AST_SCRIPT, cp->if_true_block, NULL, t.depth + 1);
+				ast_push(&stack, AST_THEN, cp, NULL, t.depth);
+				ast_push(&stack, AST_SCRIPT, cp->predicate, NULL, t.depth + 1);
+				break;
+			}
+			case AST_THEN:
+				space(f, t.depth);
+				fprintf(f, "then:\n");
+				break;
+			case AST_ELSE: {
+				const struct conditional *conditional = t.node;
+				if (conditional->else_block != NULL) {
+					space(f, t.depth);
+					fprintf(f, "else:\n");
+					ast_push(&stack, AST_SCRIPT, conditional->else_block, NULL, t.depth + 1);
+				}
+				break;
+			}
+			case AST_FOR_LOOP: {
+				const struct for_loop *for_loop = t.node;
+				space(f, t.depth);
+				fprintf(f, "for %s in ", for_loop->var_name->text);
+				print_words(f, for_loop->var_values);
+				fprintf(f, "; %sdo\n", for_loop->parallel ? "parallel " : "");
+				ast_push(&stack, AST_SCRIPT, for_loop->script, NULL, t.depth + 1);
+				break;
+			}
+			case AST_WHILE_LOOP: {
+				const struct while_loop *while_loop = t.node;
+				space(f, t.depth);
+				fprintf(f, "while:\n");
+				ast_push(&stack, AST_SCRIPT, while_loop->script, NULL, t.depth + 1);
+				ast_push(&stack, AST_DO, while_loop, NULL, t.depth);
+				ast_push(&stack, AST_SCRIPT, while_loop->predicate, NULL, t.depth + 1);
+				break;
+			}
+			case AST_DO:
+				space(f, t.depth);
+				fprintf(f, "do:\n");
+				break;
+			case AST_VAR_ASSIGN: {
+				const struct var_assign *var_assign = t.node;
+				space(f, t.depth);
+				fprintf(f, "var_assign: %s = ", var_assign->var_name);
+				print_words(f, var_assign->var_value);
+				fprintf(f, "\n");
+				break;
+			}
+		}
 	}
 }
 
 void print_or_programs(FILE *f, const struct program *program, int depth) {
-	space(f, depth);
-	fprintf(f, "or || programs:\n");
-	print_program(f, program->lhs, depth + 1);
-	print_program(f, program->rhs, depth + 1);
+	print_ast(f, AST_PROGRAM, program, depth);
 }
 
 void print_and_programs(FILE *f, const struct program *program, int depth) {
-	space(f, depth);
-	fprintf(f, "and && programs:\n");
-	print_program(f, program->lhs, depth + 1);
-	print_program(f, program->rhs, depth + 1);
+	print_ast(f, AST_PROGRAM, program, depth);
 }
 
 void print_pipe_programs(FILE *f, const struct program *program, int depth) {
-	space(f, depth);
-	fprintf(f, "pipe | programs:\n");
-	print_program(f, program->lhs, depth + 1);
-	print_program(f, program->rhs, depth + 1);
+	print_ast(f, AST_PROGRAM, program, depth);
+}
+
+void print_fanout_program(FILE *f, const struct program *program, int depth) {
+	print_ast(f, AST_PROGRAM, program, depth);
 }
 
 void print_program(FILE *f, const struct program *program, int depth) {
-	if (program->print_fn) {
-		program->print_fn(f, program, depth);
-	} else if (program->script) {
-		print_script(f, program->script, depth);
-	} else {
-		space(f, depth);
-		fprintf(f, "program: ");
-		print_words(f, program->words);
-		fprintf(f, "\n");
-	}
+	print_ast(f, AST_PROGRAM, program, depth);
 }
 
 void print_conditional(FILE *f, const struct conditional *conditional, int depth) {
-	int i = 0;
-	for (const struct conditional_part *cp = conditional->first; cp != NULL; cp = cp->next) {
-		space(f, depth);
-		fprintf(f, "%sif:\n", i++ ? "el" : "");
-		print_script(f, cp->predicate, depth + 1);
-		space(f, depth);
-		fprintf(f, "then:\n");
-		print_script(f, cp->if_true_block, depth + 1);
-	}
-	if (conditional->else_block != NULL) {
-		space(f, depth);
-		fprintf(f, "else:\n");
-		print_script(f, conditional->else_block, depth + 1);
-	}	
+	print_ast(f, AST_CONDITIONAL, conditional, depth);
 }
 
 void print_for_loop(FILE *f, const struct for_loop *for_loop, int depth) {
-	space(f, depth);
-	fprintf(f, "for %s in ", for_loop->var_name->text);
-	print_words(f, for_loop->var_values);
-	fprintf(f, "; %sdo\n", for_loop->parallel ? "parallel " : "");
-	print_script(f, for_loop->script, depth + 1);
+	print_ast(f, AST_FOR_LOOP, for_loop, depth);
 }
 
 void print_var_assign(FILE *f, const struct var_assign *var_assign, int depth) {
-	space(f, depth);
-	fprintf(f, "var_assign: %s = ", var_assign->var_name);
-	print_words(f, var_assign->var_value);
-	fprintf(f, "\n");
+	print_ast(f, AST_VAR_ASSIGN, var_assign, depth);
 }
 
 void print_statement(FILE *f, const struct statement *statement, int depth) {
-	if (statement->for_loop != NULL) {
-		print_for_loop(f, statement->for_loop, depth);
-	}
-	if (statement->conditional != NULL) {
-		print_conditional(f, statement->conditional, depth);	
-	}
-	if (statement->program != NULL) {
-		print_program(f, statement->program, depth);
-	}
-	if (statement->var_assign != NULL) {
-		print_var_assign(f, statement->var_assign, depth);	
-	}
+	print_ast(f, AST_STATEMENT, statement, depth);
 }
 
 void print_script(FILE *f, const struct script *script, int depth) {
-	space(f, depth);
-	fprintf(f, "script:\n");
-	for (const struct statement *s = script->first; s != NULL; s = s->next) {
-		print_statement(f, s, depth + 1);
-	}
+	print_ast(f, AST_SCRIPT, script, depth);
 }
 
-#define FREE_LL(t, x)	do { struct t *p = x->first; while (p) { struct t *next = p->next; free_##t(p); p = next; } } while(0)
-
 void free_word(struct word *word) {
 	free((void *) word->text);
+	free_arith(word->arith);
 	free(word);
+	memstat_add(MEMSTAT_AST, -1);
 }
 
 void free_words(struct words *words) {
-	FREE_LL(word, words);
+	struct word *p = words->first;
+	while (p) {
+		struct word *next = p->next;
+		free_word(p);
+		p = next;
+	}
 	free(words);
+	memstat_add(MEMSTAT_AST, -1);
+}
+
+static void free_ast(int kind, void *node) {
+	struct ast_stack stack = { 0 };
+	struct ast_task t;
+
+	ast_push(&stack, kind, node, NULL, 0);
+	while (ast_pop(&stack, &t)) {
+		// Every kind pushed here is a node of its own.
+		memstat_add(MEMSTAT_AST, -1);
+		switch (t.kind) {
+			case AST_SCRIPT: {
+				struct script *script = (struct script *)t.node;
+				for (struct statement *s = script->first; s != NULL; s = s->next)
+					ast_push(&stack, AST_STATEMENT, s, NULL, 0);
+				free_bytecode(script->code);
+				free(script);
+				break;
+			}
+			case AST_STATEMENT: {
+				struct statement *statement = (struct statement *)t.node;
+				ast_push(&stack, AST_FOR_LOOP, statement->for_loop, NULL, 0);
+				ast_push(&stack, AST_WHILE_LOOP, statement->while_loop, NULL, 0);
+				ast_push(&stack, AST_CONDITIONAL, statement->conditional, NULL, 0);
+				ast_push(&stack, AST_PROGRAM, statement->program, NULL, 0);
+				ast_push(&stack, AST_VAR_ASSIGN, statement->var_assign, NULL, 0);
+				free_bytecode(statement->code);
+				free_bytecode(statement->fg_code);
+				free(statement);
+				break;
+			}
+			case AST_PROGRAM: {
+				struct program *program = (struct program *)t.node;
+				if (program->words)
+					free_words(program->words);
+				if (program->const_argv)
+					free_argv(program->const_argv);
+				free_bytecode(program->code);
+				ast_push(&stack, AST_PROGRAM, program->lhs, NULL, 0);
+				ast_push(&stack, AST_PROGRAM, program->rhs, NULL, 0);
+				ast_push(&stack, AST_SCRIPT, program->script, NULL, 0);
+				free(program);
+				break;
+			}
+			case AST_CONDITIONAL: {
+				struct conditional *conditional = (struct conditional *)t.node;
+				for (struct conditional_part *cp = conditional->first; cp != NULL; cp = cp->next)
+					ast_push(&stack, AST_CONDITIONAL_PART, cp, NULL, 0);
+				ast_push(&stack, AST_SCRIPT, conditional->else_block, NULL, 0);
+				free_bytecode(conditional->code);
+				free(conditional);
+				break;
+			}
+			case AST_CONDITIONAL_PART: {
+				struct conditional_part *cp = (struct conditional_part *)t.node;
+				ast_push(&stack, AST_SCRIPT, cp->predicate, NULL, 0);
+				ast_push(&stack, AST_SCRIPT, cp->if_true_block, NULL, 0);
+				free(cp);
+				break;
+			}
+			case AST_FOR_LOOP: {
+				struct for_loop *for_loop = (struct for_loop *)t.node;
+				free_word(for_loop->var_name);
+				if (for_loop->var_values)
+					free_words(for_loop->var_values);
+				ast_push(&stack, AST_SCRIPT, for_loop->script, NULL, 0);
+				free_bytecode(for_loop->code);
+				free(for_loop);
+				break;
+			}
+			case AST_WHILE_LOOP: {
+				struct while_loop *while_loop = (struct while_loop *)t.node;
+				ast_push(&stack, AST_SCRIPT, while_loop->predicate, NULL, 0);
+				ast_push(&stack, AST_SCRIPT, while_loop->script, NULL, 0);
+				free(while_loop);
+				break;
+			}
+			case AST_VAR_ASSIGN: {
+				struct var_assign *var_assign = (struct var_assign *)t.node;
+				free((void *)var_assign->var_name);
+				free_words(var_assign->var_value);
+				free(var_assign);
+				break;
+			}
+		}
+	}
 }
 
 void free_program(struct program *program) {
-	if (program->words)
-		free_words(program->words);
-	if (program->lhs)
-		free_program(program->lhs);
-	if (program->rhs)
-		free_program(program->rhs);
-	free(program);
+	free_ast(AST_PROGRAM, program);
 }
 
 void free_for_loop(struct for_loop *for_loop) {
-	free_word(for_loop->var_name);
-	free_words(for_loop->var_values);
-	free_script(for_loop->script);
-	free(for_loop);
+	free_ast(AST_FOR_LOOP, for_loop);
+}
+
+void free_while_loop(struct while_loop *while_loop) {
+	free_ast(AST_WHILE_LOOP, while_loop);
 }
 
 void free_var_assign(struct var_assign *var_assign) {
-	free((void *)var_assign->var_name);
-	free_words(var_assign->var_value);
-	free(var_assign);
+	free_ast(AST_VAR_ASSIGN, var_assign);
 }
 
 void free_statement(struct statement *statement) {
-	if (statement->for_loop)
-		free_for_loop(statement->for_loop);
-	if (statement->conditional)
-		free_conditional(statement->conditional);
-	if (statement->program)
-		free_program(statement->program);
-	if (statement->var_assign)
-		free_var_assign(statement->var_assign);
-	free(statement);
+	free_ast(AST_STATEMENT, statement);
 }
 
 void free_script(struct script *script) {
-	FREE_LL(statement, script);
-	free(script);
+	free_ast(AST_SCRIPT, script);
 }
 
 void free_conditional_part(struct conditional_part *conditional_part) {
-	free_script(conditional_part->predicate);
-	free_script(conditional_part->if_true_block);
-	free(conditional_part);
+	free_ast(AST_CONDITIONAL_PART, conditional_part);
 }
 
 void free_conditional(struct conditional *conditional) {
-	FREE_LL(conditional_part, conditional);
-	if (conditional->else_block)
-		free_script(conditional->else_block);
-	free(conditional);
+	free_ast(AST_CONDITIONAL, conditional);
 }
 
 static void context_empty_env_tree(struct context *context) {
@@ -228,13 +438,18 @@ static void context_empty_env_tree(struct context *context) {
 		const char *e = *(const char **)context->env_tree;
 		tdelete(e, &context->env_tree, env_tree_compare);
 		free((void *)e);
+		memstat_add(MEMSTAT_ENV, -1);
 	}
 }
 
 void free_context(struct context *context) {
 	context_empty_env_tree(context);
-	context_empty_pid_wait_tree(context);
+	jobs_wait(context);
+	free_jobs(context->jobs);
+	free_launch_attrs(context->launch_attrs);
+	free_lookahead_cache(context);
 	free(context);
+	memstat_add(MEMSTAT_CONTEXT, -1);
 }
 
 static struct argv_buf *argv_buf_expand(struct argv_buf *buf) {
@@ -266,17 +481,35 @@ static struct argv_buf *argv_buf_puts(struct argv_buf *buf, const char *s) {
 
 struct argv_buf *make_argv(const struct context *context, const struct words *words) {
 	struct argv_buf *buf = malloc(sizeof(*buf));
+	memstat_add(MEMSTAT_ARGV, 1);
 	buf->argv = 0;
 	buf->argc = 0;
 	buf->used = 0;
 	buf->capacity = sizeof(buf->buf);
+	buf->error = 0;
 
-	for (const struct word *word = words->first; word != NULL; word = word->next) {
+	// 'for x in ; do' has no words at all. 'words' can be a run of a longer list (see
+	// lsh_range.c), so stop at its last word.
+	for (const struct word *word = words ? words->first : NULL; word != NULL; word = word == words->last ? NULL : word->next) {
 		if (word->is_var) {
 			const char *var = context_get_var(context, word->text);
 			if (var) {
 				buf = argv_buf_puts(buf, var);	// FIXME
 			}
+		} else if (word->is_range) {
+			struct range range;
+			range_begin(&range, word->text);
+			for (const char *value; (value = range_next(&range)) != NULL; )
+				buf = argv_buf_puts(buf, value);
+		} else if (word->is_arith) {
+			char number[24];
+			int64_t value;
+			if (arith_eval(context, word, &value) != 0) {
+				buf->error = 1;
+				continue;
+			}
+			snprintf(number, sizeof(number), "%" PRId64, value);
+			buf = argv_buf_puts(buf, number);
 		} else {
 			buf = argv_buf_puts(buf, word->text);
 		}
@@ -311,57 +544,91 @@ struct argv_buf *make_argv(const struct context *context, const struct words *wo
 void free_argv(struct argv_buf *buf) {
 	if (buf->argv) free(buf->argv);
 	free(buf);
+	memstat_add(MEMSTAT_ARGV, -1);
 }
 
 int run_conditional(struct context *context, const struct conditional *conditional, struct run_context *run_context) {
+	return bytecode_run(context, run_context, BC_CONDITIONAL, conditional);
+}
+
+// Convert a waitpid() status into a shell return code.
+int wait_status_to_rc(int wstatus) {
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	if (WIFSIGNALED(wstatus))
+		return 128 + WTERMSIG(wstatus);
+	return wstatus;
+}
+
+// Runs each iteration of a 'pdo' loop in its own child process, forked as its
+// value is generated, then waits for all of them. The return code is that of
+// the first failing iteration, if any.
+int run_parallel_for_loop(struct context *context, const struct for_loop *for_loop, struct run_context *run_context) {
 	int rc = 0;
-	for (const struct conditional_part *cp = conditional->first; cp != NULL; cp = cp->next) {
-		rc = run_script(context, cp->predicate, run_context);
-		if (rc == 0) {
-			// take this block and return.
-			return run_script(context, cp->if_true_block, run_context);
+	int n = 0;
+	int capacity = 16;
+	struct for_values *values = for_values_begin(context, for_loop->var_values);
+	if (values == NULL)
+		return 1;
+	pid_t *pids = malloc(sizeof(pid_t) * capacity);
+
+	// Don't let the children inherit (and later flush) buffered output.
+	fflush(stdout);
+	for (const char *value; (value = for_values_next(values)) != NULL; n++) {
+		if (n == capacity) {
+			capacity <<= 1;
+			pids = realloc(pids, sizeof(pid_t) * capacity);
+		}
+		context_set_var(context, for_loop->var_name->text, value);
+		pids[n] = fork();
+		if (pids[n] == -1) {
+			printf("[lsh_ast.c -> run_parallel_for_loop()] fork error: %d\n", errno);
+		} else if (pids[n] == 0) {
+			// Worker 'n' gets pinned to the n'th allowed cpu when 'spawnattr spread on' is set.
+			apply_launch_attrs(context, n);
+			deadline_group(context, run_context);
+			// The parent's buffered input (see lsh_read.c) isn't this child's to read.
+			run_context->reader = NULL;
+			run_context->exec_tail = 1;
+			exit(run_script(context, for_loop->script, run_context));
 		}
 	}
-	if (conditional->else_block != NULL) {
-		rc = run_script(context, conditional->else_block, run_context);
+	for_values_end(values);
+
+	// Reap the workers as they finish, through the event loop. The deadline bounds the whole loop;
+	// like timeout(1), an expired one returns 124.
+	int *statuses = malloc(sizeof(int) * (n + 1));
+	if (wait_children(context, pids, statuses, n, command_timeout_ms(context, run_context), command_kill_grace_ms(context, run_context)))
+		rc = 124;
+	for (int i = 0; i < n; i++) {
+		if (rc != 0)
+			break;
+		rc = pids[i] == -1 ? EAGAIN : wait_status_to_rc(statuses[i]);
 	}
+
+	free(statuses);
+	free(pids);
 	return rc;
 }
 
 int run_for_loop(struct context *context, const struct for_loop *for_loop, struct run_context *run_context) {
-	int rc = 0;
-	struct argv_buf *buf = make_argv(context, for_loop->var_values);
-
-	for (int i = 0; i < buf->argc; i++) {
-		context_set_var(context, for_loop->var_name->text, buf->argv[i]);
-		rc = run_script(context, for_loop->script, run_context);
-	}
-
-	free_argv(buf);
-	return rc;
+	return bytecode_run(context, run_context, BC_FOR_LOOP, for_loop);
 }
 
 int run_var_assign(struct context *context, const struct var_assign *var_assign, struct run_context *run_context) {
 	struct argv_buf *buf = make_argv(context, var_assign->var_value);
+	int rc = buf->error;
 	(void)run_context;
 
-	context_set_var(context, var_assign->var_name, buf->argv[0]);
+	if (!buf->error)
+		context_set_var(context, var_assign->var_name, buf->argv[0]);
 
 	free_argv(buf);
-	return 0;
+	return rc;
 }
 
 int run_fg_statement(struct context *context, const struct statement *statement, struct run_context *run_context) {
-	if (statement->conditional)
-		return run_conditional(context, statement->conditional, run_context);
-	if (statement->program) {
-		return run_program(context, statement->program, run_context);
-	}
-	if (statement->for_loop)
-		return run_for_loop(context, statement->for_loop, run_context);
-	if (statement->var_assign)
-		return run_var_assign(context, statement->var_assign, run_context);
-	return -ENOSYS;
+	return bytecode_run(context, run_context, BC_FG_STATEMENT, statement);
 }
 
 /******************************************************************************************************
@@ -371,26 +638,6 @@ int run_fg_statement(struct context *context, const struct statement *statement,
  ******************************************************************************************************/
 
 
-/*static*/ void context_pid_wait_tree_add(struct context *context, int pid) {
-	tsearch((void*)(uintptr_t)pid, &context->pid_wait_tree, pid_wait_tree_compare);
-}
-
-/*static*/ void context_empty_pid_wait_tree(struct context *context) {
-	// This loop will iterate through all pids inserted into pid_wait_tree.
-	while (context->pid_wait_tree != NULL) {
-		int pid = *(int *)context->pid_wait_tree;
-		tdelete((void *)(uintptr_t)pid, &context->pid_wait_tree, pid_wait_tree_compare);
-		// Here we want to wait on the child process with process id 'pid'.
-		// Your code goes here (Section 5)
-
-		// Wait for the child process, identified by the pid from the pid tree, to terminate, and
-		// pass its wstatus argument to a null pointer. No flags are used in this function call as
-		// indicated by the third argument being zero
-		if(waitpid(pid, NULL, 0) != pid)
-			printf("[lsh_ast.c -> run_one_program()] waitpid error: %d\n", errno);
-	}
-}
-
 // Determines if the given command (string) is an intrinsic command (see sections 3 and 4)
 // Return 1 if the command is an intrinsic and 0 otherwise
 int is_builtin(const char *argv0) {
@@ -410,20 +657,60 @@ int is_builtin(const char *argv0) {
 	// if(strcmp(argv0, "pwd") == 0)
 	// 	return 1;
 
+	if (strcmp(argv0, "spawnattr") == 0)
+		return 1;
+
+	if (strcmp(argv0, "timeout") == 0)
+		return 1;
+
+	if (strcmp(argv0, "memo") == 0)
+		return 1;
+
+	if (strcmp(argv0, "echo") == 0)
+		return 1;
+
+	if (strcmp(argv0, "read") == 0)
+		return 1;
+
+	if (strcmp(argv0, "batch") == 0)
+		return 1;
+
+	if (strcmp(argv0, "memstats") == 0)
+		return 1;
+
 	return 0;
 }
 
 // Handle an intrinsic command.
-// Takes in context, instrinsic command + arguments, and the length of argv
+// Takes in context, the run context (for builtins that run a command themselves),
+// instrinsic command + arguments, and the length of argv
 // Hint: which system call can change the current working directory of a process?
 // Hint: the home directory is in the environment variable 'HOME'
-int handle_builtin(struct context *context, char **argv, int argc) {
-	(void) context;	 // Line can likely be removed once implementation is done.
-	(void) argv;     // Line can likely be removed once implementation is done.
-	(void) argc;     // Line can likely be removed once implementation is done.
+int handle_builtin(struct context *context, struct run_context *run_context, char **argv, int argc) {
 	if (strcmp(argv[0], "exit") == 0)
 		exit(0);
 
+	if (strcmp(argv[0], "spawnattr") == 0)
+		return handle_spawnattr(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "timeout") == 0)
+		return handle_timeout(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "memo") == 0)
+		return handle_memo(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "echo") == 0)
+		return handle_echo(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "read") == 0)
+		return handle_read(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "batch") == 0)
+		return handle_batch(context, run_context, argv, argc);
+
+	if (strcmp(argv[0], "memstats") == 0)
+		return handle_memstats(context, run_context, argv, argc);
+
 	// Your code goes here (Sections 4 & 5)
 
 	// Check to see if the first argument is the cd command
@@ -468,7 +755,7 @@ int handle_builtin(struct context *context, char **argv, int argc) {
 
 	// Check to see if the first argument is the wait command
 	if(strcmp(argv[0], "wait") == 0) {
-		context_empty_pid_wait_tree(context);
+		jobs_wait(context);
 	}
 
 	// Check to see if the first argument is the pwd command
@@ -485,7 +772,7 @@ int handle_builtin(struct context *context, char **argv, int argc) {
 		printf("%s\n", wd_path);
 	}
 
-	return EINVAL;
+	return 0;
 }
 
 // Run one program, waiting for it to complete.
@@ -504,19 +791,37 @@ int run_one_program(struct context *context, const struct program *program, stru
 
 	// Your code goes here (Section 3 & 7)
 
+	// The last command of a forked child (see lsh_bytecode.c) replaces that child rather than fork
+	// again. A deadline needs a parent to enforce it, so with one the command is still forked.
+	// Either way what builtins have printed so far is written out first, so that it comes before
+	// the command's output (and isn't discarded by exec).
+	int in_place = run_context->exec_tail && command_timeout_ms(context, run_context) == 0;
+	fflush(stdout);
+
 	// Fork the parent process and store the pid of the child
-	pid_t child_pid = fork();
+	pid_t child_pid = in_place ? 0 : fork();
 
 	if(child_pid == -1) {
 		// If the fork returns -1, then there was an error forking the process
 		printf("[lsh_ast.c -> run_one_program()] fork error: %d\n", errno);
 	} else if(child_pid > 0) { // Parent process
 		// Wait for the child process, identified by the pid generated by fork(), to terminate, and
-		// pass its wstatus argument to the rc variable. No flags are used in this function call as
-		// indicated by the third argument being zero. This is run on the parent process.
-		if(waitpid(child_pid, &rc, 0) != child_pid)
-			printf("[lsh_ast.c -> run_one_program()] waitpid error: %d\n", errno);
+		// pass its wstatus argument to the rc variable. The event loop enforces any 'timeout' or
+		// LSH_CMD_TIMEOUT deadline; like timeout(1), an expired deadline returns 124.
+		int wstatus;
+		// While the child starts up, get the next statements ready; the deadline is armed first.
+		if (wait_children_idle(context, &child_pid, &wstatus, 1, command_timeout_ms(context, run_context),
+				command_kill_grace_ms(context, run_context), lookahead_prefetch))
+			rc = 124;
+		else
+			rc = wait_status_to_rc(wstatus);
 	} else { // Child process
+		// Apply any 'spawnattr' cpu affinity, niceness and cgroup settings before exec, and lead a
+		// process group for a deadline, so that it reaches anything the command forks.
+		apply_launch_attrs(context, -1);
+		if (!in_place)
+			deadline_group(context, run_context);
+
 		// Override the standard input file descriptor with the input file descriptor passed 
 		// through run context. This ends up being a pipe file descriptor, or normal standard in.
 		dup2(run_context->stdin_fd, STDIN_FILENO);
@@ -526,52 +831,84 @@ int run_one_program(struct context *context, const struct program *program, stru
 		dup2(run_context->stdout_fd, STDOUT_FILENO);
 
 		// Execute the requested command from the program structure *program and pass in the arguments
-		// from the argv_buf, *buf. This is run on the child process.
+		// from the argv_buf, *buf. This is run on the child process. A command the lookahead has
+		// already found on PATH is exec'd directly; if that fails, execvp searches as usual.
+		const char *path = lookahead_cached_path(context, argv->argv[0]);
+		if (path)
+			execv(path, argv->argv);
 		if(execvp(argv->argv[0], argv->argv) == -1)
 			printf("[lsh_ast.c -> run_one_program()] execvp error: %d\n", errno);
+
+		// The child must not return into the shell's executor if exec failed.
+		exit(127);
 	}
 
 	return rc;
 }
 
+// Run an already expanded argv, either as a builtin or in a child process.
+// Used by builtins that take a command to run, such as 'spawnattr ... -- cmd'.
+int run_argv(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	if (argc == 0)
+		return 0;
+	if (is_builtin(argv[0]))
+		return handle_builtin(context, run_context, argv, argc);
+
+	struct argv_buf view = { .argv = argv, .argc = argc };
+	return run_one_program(context, NULL, run_context, &view);
+}
+
 // Run one or many programs.
 // If the command is an intrinsic (like 'cd'), it will be handled by handle_builtin.
-// Compound programs are handled by dedicated handlers, which will need modifications.
-// Otherwise, you need to write code to handle it here in a child subprocess.
-// Hint: The shell (parent) needs to wait for the child to finish executing.
+// Compound programs are compiled and run by the executor (lsh_bytecode.c).
 int run_program(struct context *context, const struct program *program, struct run_context *run_context) {
-	if (program->run_fn) {
-		return program->run_fn(context, program, run_context);
-	}
-	if (program->script) {
-		return run_script(context, program->script, run_context);
-	}
+	return bytecode_run(context, run_context, BC_PROGRAM, program);
+}
 
+// Run a single, non-combination program: expand its words, then run it as a
+// builtin or in a child subprocess.
+int run_simple_program(struct context *context, const struct program *program, struct run_context *run_context) {
 	CHECK(program->words);
 
-	int rc;
-	struct argv_buf *argv = make_argv(context, program->words);
+	int rc = 0;
+	// Commands without variables are only expanded once.
+	struct argv_buf *const_argv = program_const_argv(context, program);
+	struct argv_buf *argv = const_argv ? const_argv : make_argv(context, program->words);
+
+	// A failed '$((...))' fails the command; an empty expansion, such as an unset '$VAR' on its
+	// own, runs nothing.
+	if (argv->error) {
+		rc = 1;
+		goto out;
+	}
+	if (argv->argc == 0)
+		goto out;
 
-	// If this is a builtin, run it. Otherwise, fork and exec.
+	// If this is a builtin, run it. Otherwise, fork and exec. A command a builtin runs itself
+	// ('spawnattr ... -- cmd') returns to it, so it is never exec'd in place.
 	if (is_builtin(argv->argv[0])) {
-		rc = handle_builtin(context, argv->argv, argv->argc);
+		int exec_tail = run_context->exec_tail;
+		run_context->exec_tail = 0;
+		rc = handle_builtin(context, run_context, argv->argv, argv->argc);
+		run_context->exec_tail = exec_tail;
 		goto out;
 	}
 
 	rc = run_one_program(context, program, run_context, argv);
 
 out:
-	free_argv(argv);
+	if (argv != const_argv)
+		free_argv(argv);
 	return rc;
 }
 
 // Run a command in the background (spawn as a child process but do not wait)
 // Note: need to keep track of all background child PIDs in case the user wants to call wait
+// Any statement can be backgrounded; the child runs it as a foreground statement, exec'ing its
+// last command in place rather than forking it.
 void run_bg_statement(struct context *context, const struct statement *statement, struct run_context *run_context) {
-	// Create the argv buffer using built in functions
-	struct argv_buf *argv = make_argv(context, statement->program->words);
-
 	// Fork the parent process and save the pid of the child
+	fflush(stdout);
 	pid_t child_pid = fork();
 
 	if(child_pid == -1) {
@@ -579,121 +916,232 @@ void run_bg_statement(struct context *context, const struct statement *statement
 		printf("[lsh_ast.c -> run_bg_statement()] fork error: %d\n", errno);
 	} else if(child_pid > 0) {
 		// The parent process shouldn't wait on the child, instead it simply adds the child pid
-		// to the pid wait tree for later processing.
-		context_pid_wait_tree_add(context, child_pid);
+		// to the job table, which reaps it when it finishes and enforces its deadline.
+		jobs_add(context, child_pid, command_timeout_ms(context, run_context), command_kill_grace_ms(context, run_context));
 	} else {
-		// Execute the requested command from the program structure and pass in the arguments
-		// from the generated argv buffer. This is run on the child process.
-		if(execvp(statement->program->words->first->text, argv->argv) == -1)
-			printf("[lsh_ast.c -> run_one_program()] execvp error: %d\n", errno);
+		// Apply 'spawnattr' settings to the whole job, then run the statement in this child.
+		apply_launch_attrs(context, -1);
+		deadline_group(context, run_context);
+		run_context->reader = NULL;
+		run_context->exec_tail = 1;
+		exit(run_fg_statement(context, statement, run_context));
 	}
-
-	// Make sure the argv buffer is freed afterwords (hopefully lol)
-	free_argv(argv);
 }
 
-// Execute the pipe stream of commands, which is two commands chained together with a pipe (|)
+// Execute the pipe stream of commands, which is two or more commands chained together with pipes (|)
 // i.e. cat /usr/share/dict/words | grep ^z.*o$
-// See the pipe_steam struct in lsh_ast.h. It contains the command before the pipe and the command after the pipe.
-// run_pipe_stream returns the status code of the last member of the pipe. 0 = success, anything else is failure.
-// Hint: see 'man pipe' to create a pipe between processes
-// Hint: see 'man dup2' for making one file descriptor (i.e. stdin or stdout) point to another.
+// The pipe programs form a tree of lhs/rhs pairs; it is flattened into a list of stages first, so
+// that a long pipeline neither recurses nor forks a chain of nested children. Every stage but the
+// last runs in its own child with its stdin and stdout connected to the neighbouring pipes, and a
+// stage's last command is exec'd in that child rather than forked from it; the last stage runs in
+// the shell with its stdin redirected, as a single command would.
+// run_pipe_programs returns the status code of the last member of the pipe. 0 = success, anything else is failure.
 int run_pipe_programs(struct context *context, const struct program *program, struct run_context *run_context) {
 	int rc = -ENOSYS;
+	int n = 0;
+	int capacity = 8;
+	const struct program **stages = malloc(sizeof(*stages) * capacity);
+	int npending = 0;
+	int pending_capacity = 8;
+	const struct program **pending = malloc(sizeof(*pending) * pending_capacity);
+
+	// In-order walk of the pipe nodes, collecting the stages left to right.
+	pending[npending++] = program;
+	while (npending > 0) {
+		const struct program *p = pending[--npending];
+		if (n == capacity) {
+			capacity <<= 1;
+			stages = realloc(stages, sizeof(*stages) * capacity);
+		}
+		if (npending + 2 > pending_capacity) {
+			pending_capacity <<= 1;
+			pending = realloc(pending, sizeof(*pending) * pending_capacity);
+		}
+		if (p->run_fn == run_pipe_programs) {
+			pending[npending++] = p->rhs;
+			pending[npending++] = p->lhs;
+		} else {
+			stages[n++] = p;
+		}
+	}
+	free(pending);
+
+	// Builtins that only write output (see lsh_threads.c) run on a thread rather than in a forked
+	// child. Their arguments are expanded here, before any thread starts, as expansion reads the
+	// shell's variables. Only a stage whose command is written out literally is expanded: any other
+	// is expanded once, by the child that runs it.
+	struct argv_buf **thread_argv = calloc(n, sizeof(*thread_argv));
+	pthread_t *threads = malloc(sizeof(pthread_t) * n);
+	int *thread_out = malloc(sizeof(int) * n);
+	int nthreads = 0;
+	for (int i = 0; i < n; i++) {
+		thread_out[i] = -1;
+		const struct word *first = stages[i]->words ? stages[i]->words->first : NULL;
+		if (first == NULL || first->is_var || first->is_arith || first->is_range || !is_thread_builtin(first->text))
+			continue;
+		// A failed '$((...))' is kept too, so the stage fails here without being expanded again.
+		struct argv_buf *argv = make_argv(context, stages[i]->words);
+		if (argv->error || (argv->argc > 0 && is_thread_builtin(argv->argv[0]))) {
+			thread_argv[i] = argv;
+			nthreads++;
+		} else {
+			free_argv(argv);
+		}
+	}
 
-	// Your code goes here (Section 7)
+	// Without threads, the last stage runs in the shell. With them, a last command is forked like
+	// the others (unless it is a thread builtin itself): every fork happens before the threads
+	// start, so that no child can inherit, and hold open, the write end of a thread's pipe. A last
+	// stage that is a while loop or sub-shell still runs in the shell, so that its variables are
+	// kept either way; the children it forks get the thread pipes close-on-exec.
+	const struct program *last = stages[n - 1];
+	int fork_last = nthreads > 0 && thread_argv[n - 1] == NULL && !(last->script && last->run_fn == NULL);
+	int nspawn = fork_last ? n : n - 1;
+	pid_t *pids = malloc(sizeof(pid_t) * n);
+	int prev_read = run_context->stdin_fd;
+	int failed = 0;
+	// The deadline bounds the pipeline as a whole, from here.
+	long started = now_ms();
+
+	// Don't let the children inherit (and later flush) buffered output.
+	fflush(stdout);
+	for (int i = 0; i < n; i++)
+		pids[i] = -1;
+	for (int i = 0; i < nspawn; i++) {
+		// Create a pipe and check for an error
+		int pipefd[2] = { -1, -1 };
+		if (i < n - 1 && pipe(pipefd) != 0) {
+			printf("[lsh_ast.c -> run_pipe_programs()] pipe error %d\n", errno);
+			failed = 1;
+			break;
+		}
 
-	// Create a pipe and check for an error
-	int pipefd[2];
-	if(pipe(pipefd) != 0) {
-		printf("[lsh_ast.c -> run_pipe_programs()] pipe error %d\n", errno);
-		return rc;
-	}
+		if (thread_argv[i]) {
+			// The thread keeps the write end; it doesn't read, so drop its input now and let the
+			// previous stage see EPIPE as it would writing to a process that exited.
+			thread_out[i] = pipefd[1];
+			fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+			if (prev_read != run_context->stdin_fd)
+				close(prev_read);
+			prev_read = pipefd[0];
+			continue;
+		}
 
-	// Fork the parent process and store the pid of the child
-	pid_t child_pid = fork();
+		pids[i] = fork();
+		if(pids[i] == -1) {
+			// If the fork returns -1, then there was an error forking the process
+			printf("[lsh_ast.c -> run_pipe_programs()] fork error: %d\n", errno);
+			if (pipefd[0] >= 0) {
+				close(pipefd[0]);
+				close(pipefd[1]);
+			}
+			failed = 1;
+			break;
+		} else if(pids[i] == 0) { // Child process
+			deadline_group(context, run_context);
+			for (int j = 0; j < i; j++) {
+				if (thread_out[j] >= 0)
+					close(thread_out[j]);
+			}
 
-	if(child_pid == -1) {
-		// If the fork returns -1, then there was an error forking the process
-		printf("[lsh_ast.c -> run_pipe_programs()] fork error: %d\n", errno);
+			// Connect stdin to the previous stage and stdout to this stage's pipe, so that builtins
+			// and sub-scripts in this stage use them too.
+			if (prev_read >= 0) {
+				dup2(prev_read, STDIN_FILENO);
+				close(prev_read);
+			}
+			if (pipefd[1] >= 0) {
+				dup2(pipefd[1], STDOUT_FILENO);
+				close(pipefd[0]);
+				close(pipefd[1]);
+			} else if (run_context->stdout_fd >= 0) {
+				dup2(run_context->stdout_fd, STDOUT_FILENO);
+			}
 
-		// Clean up before returning
-		if(close(pipefd[0]) != 0)
-			printf("[lsh_ast.c -> run_pipe_programs()] failed fork close pipefd[0] error: %d\n", errno);
+			struct run_context stage_context = *run_context;
+			stage_context.stdin_fd = -1;
+			stage_context.stdout_fd = -1;
+			stage_context.reader = NULL;
+			stage_context.exec_tail = 1;
+			rc = run_program(context, stages[i], &stage_context);
+			fflush(stdout);
 
-		if(close(pipefd[1]) != 0)
-			printf("[lsh_ast.c -> run_pipe_programs()] failed fork close pipefd[1] error: %d\n", errno);
-	} else if(child_pid > 0) { // Parent process
-	 	// The parent won't need to write to the pipe, so it's closed
-		if(close(pipefd[1]) != 0)
-			printf("[lsh_ast.c -> run_pipe_programs()] parent process close pipefd[1] error: %d\n", errno);
-
-		// The input file descriptor of the parent process is redicted to the input of the pipe fulfilled by
-		// the child process.
-		run_context->stdin_fd = pipefd[0];
-
-		// We do not wait for the child program as it may stdout more than 64KB, which will most likely lead
-		// to its program hanging indefinitely. This will cause wait to hang indefinitely as the child will
-		// still technically be executing. Therefore, the parent will not consume any of the data leaving both
-		// processes hanging and the program in deadlock.
-
-		// If the programs are nested, then call run_pipe_programs() to process all pipes, otherwise just call
-		// run_program() to process the right side of the pipe expression
-		if(program->rhs->rhs != NULL)
-			rc = run_pipe_programs(context, program->rhs, run_context);
+			// The child process needs to exit once complete, otherwise processes will execute out of order
+			exit(rc);
+		}
+
+		// The parent only passes the read end on to the next stage.
+		if (pipefd[1] >= 0)
+			close(pipefd[1]);
+		if (prev_read != run_context->stdin_fd)
+			close(prev_read);
+		prev_read = pipefd[0];
+	}
+
+	for (int i = 0; i < nspawn; i++) {
+		if (thread_argv[i] == NULL || thread_out[i] < 0)
+			continue;
+		if (!failed && !thread_argv[i]->error && start_thread_stage(context, thread_argv[i], thread_out[i], &threads[i]) == 0) {
+			thread_argv[i] = NULL;
+		} else {
+			close(thread_out[i]);
+			thread_out[i] = -1;
+		}
+	}
+
+	// We do not wait for the earlier stages before running the last one, as they may write more than
+	// the pipe can buffer and would block until it is consumed.
+	int saved_stdin_fd = run_context->stdin_fd;
+	if (!failed && !fork_last) {
+		run_context->stdin_fd = prev_read;
+		if (thread_argv[n - 1] && thread_argv[n - 1]->error)
+			rc = 1;
+		else if (thread_argv[n - 1])
+			rc = handle_builtin(context, run_context, thread_argv[n - 1]->argv, thread_argv[n - 1]->argc);
 		else
-			rc = run_program(context, program->rhs, run_context);
-	} else { // Child process
-	 	// The child won't need to read from the pipe, so it's closed
-		if(close(pipefd[0]) != 0)
-			printf("[lsh_ast.c -> run_pipe_programs()] child process close pipefd[0] error: %d\n", errno);
-		
-		// The output file descriptor of the child process is redicted to the output of the pipe consumed by
-		// the parent process.
-		run_context->stdout_fd = pipefd[1];
-
-		// Run the program on the left hand side on the child process so its result may be consumed by the parent process
-		rc = run_program(context, program->lhs, run_context);
-
-		// The output of the pipe is no longer needed, so it's closed
-		if(close(pipefd[1]) != 0)
-			printf("[lsh_ast.c -> run_pipe_programs()] child process close pipefd[1] error: %d\n", errno);
-
-		// The child process needs to exit once complete, otherwise processes will execute out of order
-		exit(rc);
+			rc = run_program(context, stages[n - 1], run_context);
+		run_context->stdin_fd = saved_stdin_fd;
+	}
+
+	// Close the last read end (so a stage still writing gets SIGPIPE rather than blocking), then reap
+	// the earlier stages so they don't linger as zombies and their resource usage is accounted to
+	// this shell.
+	if (prev_read != saved_stdin_fd && close(prev_read) != 0)
+		printf("[lsh_ast.c -> run_pipe_programs()] parent process close pipe error: %d\n", errno);
+	int *statuses = malloc(sizeof(int) * n);
+	long timeout_ms = command_timeout_ms(context, run_context);
+	if (timeout_ms > 0)
+		timeout_ms = timeout_ms > now_ms() - started ? timeout_ms - (now_ms() - started) : 1;
+	int timed_out = wait_children(context, pids, statuses, n, timeout_ms, command_kill_grace_ms(context, run_context));
+	if (!failed && fork_last)
+		rc = timed_out ? 124 : wait_status_to_rc(statuses[n - 1]);
+
+	for (int i = 0; i < n; i++) {
+		if (thread_out[i] >= 0)
+			pthread_join(threads[i], NULL);
+		if (thread_argv[i])
+			free_argv(thread_argv[i]);
 	}
 
+	free(statuses);
+	free(pids);
+	free(thread_out);
+	free(threads);
+	free(thread_argv);
+	free(stages);
 	return rc;
 }
 
 // && means you run the rhs only if the lhs returns 0/success.
+// The executor compiles the short circuit to a jump, so that long chains don't recurse.
 int run_and_programs(struct context *context, const struct program *program, struct run_context *run_context) {
-	int rc = -ENOSYS;
-
-	// Your code goes here (Section 6)
-	// Run the program on the left hand side of the &&
-	rc = run_program(context, program->lhs, run_context);
-	
-	// If the left hand side program ran successfully (return code 0), then run the right hand side of the &&
-	if(rc == 0)
-		rc = run_program(context, program->rhs, run_context);
-
-	return rc;
+	return bytecode_run(context, run_context, BC_PROGRAM, program);
 }
 
 // || means you run the rhs only if the lhs returns non-zero/failure.
+// The executor compiles the short circuit to a jump, so that long chains don't recurse.
 int run_or_programs(struct context *context, const struct program *program, struct run_context *run_context) {
-	int rc = -ENOSYS;
-
-	// Your code goes here (Section 6)
-	// Run the program on the left hand side of the ||
-	rc = run_program(context, program->lhs, run_context);
-	
-	// If the left hand side program failed (return code other than 0), then run the right hand side of the ||
-	if(rc != 0)
-		rc = run_program(context, program->rhs, run_context);
-
-	return rc;
+	return bytecode_run(context, run_context, BC_PROGRAM, program);
 }
 
 /******************************************
@@ -703,20 +1151,11 @@ int run_or_programs(struct context *context, const struct program *program, stru
  ******************************************/
 
 int run_statement(struct context *context, const struct statement *statement, struct run_context *run_context) {
-	if (statement->background) {
-		run_bg_statement(context, statement, run_context);
-		return 0;
-	} else {
-		return run_fg_statement(context, statement, run_context);
-	}
+	return bytecode_run(context, run_context, BC_STATEMENT, statement);
 }
 
 int run_script(struct context *context, const struct script *script, struct run_context *run_context) {
-	int rc;
-	for (const struct statement *s = script->first; s; s = s->next) {
-		rc = run_statement(context, s, run_context);
-	}
-	return rc;
+	return bytecode_run(context, run_context, BC_SCRIPT, script);
 }
 
 static const char *context_get_var_raw(const struct context *context, const char *key) {
@@ -730,6 +1169,8 @@ static const char *context_get_var_raw(const struct context *context, const char
 
 const char *context_get_var(const struct context *context, const char *key) {
 	const char *s = context_get_var_raw(context, key);
+	if (s == NULL)
+		return NULL;
 	return &s[strlen(key) + 1];
 }
 
@@ -746,11 +1187,14 @@ void context_set_var(struct context *context, const char *key, const char *value
 
 	//fprintf(stderr, "%s: buf: '%s'\n", __FUNCTION__, buf);
 
-	// Delete any existing value.
-	const char *s;
-	while ((s = context_get_var_raw(context, key)) != NULL) {
-		tdelete(buf, &context->env_tree, env_tree_compare);
-		free((void *)s);
+	// An existing variable's node takes the new string in place of the old one: the two compare
+	// equal, so the tree stays ordered, and it is one lookup rather than a delete and an insert.
+	const char **node = tsearch(buf, &context->env_tree, env_tree_compare);
+	CHECK(node != NULL);
+	if (*node != buf) {
+		free((void *)*node);
+		*node = buf;
+	} else {
+		memstat_add(MEMSTAT_ENV, 1);
 	}
-	tsearch(buf, &context->env_tree, env_tree_compare);
 }
\ No newline at end of file
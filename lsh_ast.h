@@ -3,19 +3,34 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <search.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/resource.h>
 
 #define CHECK(x)	do { if (!(x)) { fprintf(stderr, "%s:%d:%s: CHECK failed: %s\n", __FILE__, __LINE__, __func__, #x); abort(); } } while(0)
 
 struct run_context {
 	int stdin_fd;
 	int stdout_fd;
+	// Deadline for commands, set by the 'timeout' builtin; 0 falls back to LSH_CMD_TIMEOUT.
+	long timeout_ms;
+	// Delay between SIGTERM and SIGKILL once the deadline expires; 0 falls back to LSH_KILL_GRACE.
+	long kill_grace_ms;
+	// The buffered reader on stdin_fd that 'read' uses, set up by a 'while' loop (see lsh_read.c).
+	struct line_reader *reader;
+	// Set in a forked child that exits with the return code of what it runs: the command that
+	// runs last may replace the child with exec() rather than fork again (see lsh_bytecode.c).
+	int exec_tail;
 };
-#define DEFAULT_RUN_CONTEXT	{ -1, -1 }
+#define DEFAULT_RUN_CONTEXT	{ -1, -1, 0, 0, NULL, 0 }
 
 struct context;
 struct program;
+struct line_reader;
 typedef int (*program_pair_run_fn)(struct context *context, const struct program *program, struct run_context *run_context);
 typedef void (*program_pair_print_fn)(FILE *f, const struct program *program, int depth);
 
@@ -24,12 +39,22 @@ struct argv_buf {
 	int argc;
 	size_t used;
 	size_t capacity;
+	// An expansion failed (see lsh_arith.c); the argv must not be run.
+	int error;
 	char buf[8];	// dynamically grows.
 };
 
+struct arith_expr;
+
 struct word {
 	const char *text;
 	int is_var;
+	// A $((...)) expansion; 'text' is the expression, and 'arith' its parsed
+	// form, NULL until first evaluated.
+	int is_arith;
+	struct arith_expr *arith;
+	// A {A..B} or {A..B..STEP} range; 'text' is what is between the braces.
+	int is_range;
 	struct word *next;
 };
 
@@ -38,6 +63,8 @@ struct words {
 	struct word *last;
 };
 
+struct bytecode;
+
 // This AST node handles a program, or a combination of programs.
 struct program {
 	// If this is a single, non-combination program, 'words' holds the
@@ -59,20 +86,36 @@ struct program {
 	// An AST trick; a program can also be considered a script. This removes
 	// arbitrary restrictions of what kinds of statements are allowed where.
 	struct script *script;
+	// The argv of a words program without variables, expanded once (see
+	// lsh_lookahead.c). NULL until then.
+	struct argv_buf *const_argv;
+	// Compiled on the first run_program() of this node (see lsh_bytecode.c).
+	struct bytecode *code;
 };
 
 struct statement {
 	struct for_loop *for_loop;
+	struct while_loop *while_loop;
 	struct conditional *conditional;
 	struct program *program;
 	struct var_assign *var_assign;
 	int background;
+	// Prefixed with the 'time' keyword.
+	int timed;
+	// Already prepared by the lookahead.
+	int prefetched;
+	// Compiled on the first run (see lsh_bytecode.c): 'code' starts it as a
+	// background job, 'fg_code' runs it in the foreground. NULL until then.
+	struct bytecode *code;
+	struct bytecode *fg_code;
 	struct statement *next;
 };
 
 struct script {
 	struct statement *first;
 	struct statement *last;
+	// Compiled on the first run (see lsh_bytecode.c). NULL until then.
+	struct bytecode *code;
 };
 
 struct conditional_part {
@@ -85,6 +128,8 @@ struct conditional {
 	struct conditional_part *first;
 	struct conditional_part *last;
 	struct script *else_block;
+	// Compiled on the first run_conditional() (see lsh_bytecode.c).
+	struct bytecode *code;
 };
 
 struct for_loop {
@@ -92,6 +137,13 @@ struct for_loop {
 	struct word *var_name;
 	struct words *var_values;
 	struct script *script;
+	// Compiled on the first run_for_loop() (see lsh_bytecode.c).
+	struct bytecode *code;
+};
+
+struct while_loop {
+	struct script *predicate;
+	struct script *script;
 };
 
 struct var_assign {
@@ -99,12 +151,35 @@ struct var_assign {
 	struct words *var_value;	// Kind of a hack to make code simpler, should just be word, not words.
 };	
 
+struct launch_attrs;
+struct job_table;
+
 struct context {
 	struct script *script;
 	void *env_tree;
-	void *pid_wait_tree;
+	// Background jobs, watched from when they start (see lsh_events.c). NULL if none yet.
+	struct job_table *jobs;
+	// Attributes applied to children at spawn time, set by 'spawnattr'. NULL if none.
+	struct launch_attrs *launch_attrs;
+	// The statement after the one running, for the lookahead, and its cache of
+	// commands resolved on PATH (valid for the PATH in path_cache_key).
+	const struct statement *lookahead;
+	// When the running lookahead must stop (now_ms()).
+	long lookahead_deadline;
+	void *path_cache;
+	char *path_cache_key;
 };
 
+// The lexer's state, in the scanner's extra data (see yylex_init_extra). It is
+// reset before each parse.
+struct lex_state {
+	int prev_tok;
+	int prev2_tok;
+	// Open parentheses inside a '$((' being scanned.
+	int arith_depth;
+};
+#define LEX_STATE_INIT	{ -1, -1, 0 }
+
 void context_set_var(struct context *context, const char *key, const char *value);
 const char *context_get_var(const struct context *context, const char *key);
 int env_tree_compare(const void *_a, const void *_b);
@@ -113,17 +188,33 @@ void tsearch_print_env_tree(const void *nodep, VISIT which, int depth);
 #define append_ll(a, b)		do { if (a->first == NULL) { a->first = a->last = b; } else { a->last->next = b; a->last = b; b->next = NULL; } } while(0)
 #define prepend_ll(a, b)	do { if (a->first == NULL) { a->first = a->last = b; } else { b->next = a->first; a->first = b; } } while(0)
 
-#define CREATE_NEW_FN(x)	static inline struct x *new_##x() { struct x *p = malloc(sizeof(struct x)); memset(p, 0, sizeof(struct x)); return p; }
-CREATE_NEW_FN(word)
-CREATE_NEW_FN(words)
-CREATE_NEW_FN(program)
-CREATE_NEW_FN(statement)
-CREATE_NEW_FN(script)
-CREATE_NEW_FN(conditional_part)
-CREATE_NEW_FN(conditional)
-CREATE_NEW_FN(for_loop)
-CREATE_NEW_FN(var_assign)
-CREATE_NEW_FN(context)
+// Live allocations by category, for the 'memstats' builtin (lsh_memstats.c).
+// Updated atomically, as scripts are parsed on several threads with 'lsh -j'.
+enum memstat {
+	MEMSTAT_AST,		// AST nodes
+	MEMSTAT_ENV,		// variables
+	MEMSTAT_ARGV,		// expanded argvs
+	MEMSTAT_SCANNER,	// scanners and their input buffers
+	MEMSTAT_CONTEXT,
+	MEMSTAT_COUNT,
+};
+extern long memstats[MEMSTAT_COUNT];
+static inline void memstat_add(enum memstat stat, long delta) {
+	__atomic_add_fetch(&memstats[stat], delta, __ATOMIC_RELAXED);
+}
+
+#define CREATE_NEW_FN(x, stat)	static inline struct x *new_##x() { struct x *p = malloc(sizeof(struct x)); memset(p, 0, sizeof(struct x)); memstat_add(stat, 1); return p; }
+CREATE_NEW_FN(word, MEMSTAT_AST)
+CREATE_NEW_FN(words, MEMSTAT_AST)
+CREATE_NEW_FN(program, MEMSTAT_AST)
+CREATE_NEW_FN(statement, MEMSTAT_AST)
+CREATE_NEW_FN(script, MEMSTAT_AST)
+CREATE_NEW_FN(conditional_part, MEMSTAT_AST)
+CREATE_NEW_FN(conditional, MEMSTAT_AST)
+CREATE_NEW_FN(for_loop, MEMSTAT_AST)
+CREATE_NEW_FN(while_loop, MEMSTAT_AST)
+CREATE_NEW_FN(var_assign, MEMSTAT_AST)
+CREATE_NEW_FN(context, MEMSTAT_CONTEXT)
 
 // Hacks here because the lexer and parser are co-dependent for type definitions.
 #define YY_TYPEDEF_YY_SCANNER_T
@@ -137,6 +228,7 @@ void print_var_assign(FILE *f, const struct var_assign *var_assign, int depth);
 void print_pipe_programs(FILE *f, const struct program *program, int depth);
 void print_and_programs(FILE *f, const struct program *program, int depth);
 void print_or_programs(FILE *f, const struct program *program, int depth);
+void print_fanout_program(FILE *f, const struct program *program, int depth);
 
 void free_word(struct word *word);
 void free_words(struct words *words);
@@ -145,6 +237,8 @@ void free_statement(struct statement *statement);
 void free_script(struct script *script);
 void free_conditional_part(struct conditional_part *conditional_part);
 void free_conditional(struct conditional *conditional);
+void free_for_loop(struct for_loop *for_loop);
+void free_while_loop(struct while_loop *while_loop);
 void free_var_assign(struct var_assign *var_assign);
 void free_context(struct context *context);
 
@@ -155,6 +249,120 @@ int run_conditional(struct context *context, const struct conditional *condition
 int run_pipe_programs(struct context *context, const struct program *program, struct run_context *run_context);
 int run_and_programs(struct context *context, const struct program *program, struct run_context *run_context);
 int run_or_programs(struct context *context, const struct program *program, struct run_context *run_context);
+int is_builtin(const char *argv0);
+int handle_builtin(struct context *context, struct run_context *run_context, char **argv, int argc);
+int run_argv(struct context *context, struct run_context *run_context, char **argv, int argc);
+int run_simple_program(struct context *context, const struct program *program, struct run_context *run_context);
+int run_parallel_for_loop(struct context *context, const struct for_loop *for_loop, struct run_context *run_context);
+int run_var_assign(struct context *context, const struct var_assign *var_assign, struct run_context *run_context);
+void run_bg_statement(struct context *context, const struct statement *statement, struct run_context *run_context);
+void free_argv(struct argv_buf *buf);
+int wait_status_to_rc(int wstatus);
+struct argv_buf *make_argv(const struct context *context, const struct words *words);
+
+// lsh_launch.c
+int handle_spawnattr(struct context *context, struct run_context *run_context, char **argv, int argc);
+void apply_launch_attrs(const struct context *context, int pdo_slot);
+void free_launch_attrs(struct launch_attrs *launch_attrs);
+
+// lsh_events.c
+int wait_children(struct context *context, const pid_t *pids, int *statuses, int n, long timeout_ms, long grace_ms);
+int wait_children_idle(struct context *context, const pid_t *pids, int *statuses, int n, long timeout_ms, long grace_ms,
+		void (*idle)(struct context *context));
+void deadline_group(const struct context *context, const struct run_context *run_context);
+void jobs_add(struct context *context, pid_t pid, long timeout_ms, long grace_ms);
+void jobs_wait(struct context *context);
+void free_jobs(struct job_table *table);
+long now_ms(void);
+// Children waited for one at a time as they exit (see lsh_events.c).
+struct child_set {
+	pid_t *pids;
+	// A pidfd for each running child, or -1.
+	int *fds;
+	int capacity;
+	int running;
+	int epfd;
+};
+void child_set_init(struct child_set *set, pid_t *pids, int capacity);
+void child_set_add(struct child_set *set, int i);
+int child_set_wait_any(struct child_set *set, int *status);
+void child_set_destroy(struct child_set *set);
+int parse_duration_ms(const char *s, long *ms);
+long command_timeout_ms(const struct context *context, const struct run_context *run_context);
+long command_kill_grace_ms(const struct context *context, const struct run_context *run_context);
+int handle_timeout(struct context *context, struct run_context *run_context, char **argv, int argc);
+
+// lsh_memo.c
+int handle_memo(struct context *context, struct run_context *run_context, char **argv, int argc);
+
+// lsh_threads.c
+int is_thread_builtin(const char *argv0);
+int handle_echo(struct context *context, struct run_context *run_context, char **argv, int argc);
+int start_thread_stage(struct context *context, struct argv_buf *argv, int out_fd, pthread_t *thread);
+
+// lsh_lookahead.c
+void lookahead_prefetch(struct context *context);
+const char *lookahead_cached_path(struct context *context, const char *name);
+struct argv_buf *program_const_argv(struct context *context, const struct program *program);
+void free_lookahead_cache(struct context *context);
+
+// lsh_arith.c
+int arith_eval(const struct context *context, const struct word *word, int64_t *result);
+void free_arith(struct arith_expr *expr);
+
+// lsh_range.c
+struct range {
+	int64_t next;
+	int64_t last;
+	uint64_t step;
+	int descending;
+	int width;
+	int done;
+	char buf[32];
+};
+void range_begin(struct range *range, const char *text);
+const char *range_next(struct range *range);
+struct for_values;
+struct for_values *for_values_begin(const struct context *context, const struct words *words);
+const char *for_values_next(struct for_values *values);
+void for_values_end(struct for_values *values);
+
+// lsh_memstats.c
+int handle_memstats(struct context *context, struct run_context *run_context, char **argv, int argc);
+
+// lsh_fanout.c
+int run_fanout_program(struct context *context, const struct program *program, struct run_context *run_context);
+
+// lsh_batch.c
+int handle_batch(struct context *context, struct run_context *run_context, char **argv, int argc);
+
+// lsh_read.c
+struct line_reader *line_reader_attach(struct run_context *run_context);
+void line_reader_detach(struct run_context *run_context, struct line_reader *reader);
+int handle_read(struct context *context, struct run_context *run_context, char **argv, int argc);
+
+// lsh_bytecode.c
+// What bytecode_run is given to compile and run.
+enum bytecode_root {
+	BC_SCRIPT,
+	BC_STATEMENT,
+	BC_FG_STATEMENT,
+	BC_PROGRAM,
+	BC_CONDITIONAL,
+	BC_FOR_LOOP,
+};
+int bytecode_run(struct context *context, struct run_context *run_context, enum bytecode_root root, const void *node);
+void print_bytecode(FILE *f, struct context *context, const struct script *script);
+void free_bytecode(struct bytecode *code);
+
+// lsh_time.c
+struct time_sample {
+	struct timespec real;
+	struct rusage self;
+	struct rusage children;
+};
+void time_sample_begin(struct time_sample *sample);
+void time_sample_report(const struct context *context, const struct statement *statement, const struct time_sample *start, int rc);
 
 // Turn the actual implementation on.
 #define SOLUTION
@@ -0,0 +1,224 @@
+// The 'batch' builtin: xargs without the extra process and pipe.
+//
+//   batch [-P N] command fixed-args... -- list...
+//
+// A variable or range that expands to a huge list can make an argv too big for
+// execve, which fails with E2BIG. 'batch' splits the list into chunks that
+// each fit, and runs 'command fixed-args... chunk...' once per chunk: one after
+// the other, or with -P, up to N at a time. The return code is that of the
+// first chunk, in list order, that failed, or 0.
+//
+// The limit is sysconf(_SC_ARG_MAX), less what the environment takes and some
+// headroom, counting each argument as execve does: its bytes, its terminator
+// and its argv pointer. Setting LSH_BATCH_MAX lowers it further (for testing).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "lsh_ast.h"
+
+// What xargs leaves spare, too.
+#define BATCH_HEADROOM	2048
+#define BATCH_ARG_MAX_DEFAULT	(128 * 1024)
+
+extern char **environ;
+
+static size_t arg_cost(const char *arg) {
+	return strlen(arg) + 1 + sizeof(char *);
+}
+
+// The bytes available for one command's arguments.
+static size_t batch_limit(const struct context *context) {
+	long arg_max = sysconf(_SC_ARG_MAX);
+	size_t limit = arg_max > 0 ? (size_t)arg_max : BATCH_ARG_MAX_DEFAULT;
+	size_t env = sizeof(char *);
+
+	for (char **e = environ; *e != NULL; e++)
+		env += arg_cost(*e);
+	limit = limit > env + BATCH_HEADROOM ? limit - env - BATCH_HEADROOM : 0;
+
+	const char *max = context_get_var(context, "LSH_BATCH_MAX");
+	if (max && *max) {
+		char *end;
+		unsigned long long v = strtoull(max, &end, 10);
+		if (*end == 0 && v > 0 && v < limit)
+			limit = v;
+	}
+	return limit;
+}
+
+struct batch {
+	// The command and its fixed arguments.
+	char **fixed;
+	int nfixed;
+	// The fixed arguments, then room for a chunk and a NULL.
+	char **argv;
+	char **list;
+	int nlist;
+	// Chunk i is list[starts[i]] up to list[starts[i + 1]].
+	int *starts;
+	int nchunks;
+};
+
+// Split the list greedily into chunks that fit 'limit' together with the fixed
+// arguments. An argument too big to fit even on its own gets a chunk to itself,
+// and fails when it is run. Returns the size of the largest chunk.
+static int split_chunks(struct batch *batch, size_t limit) {
+	size_t fixed = sizeof(char *);
+	int largest = 0;
+
+	for (int i = 0; i < batch->nfixed; i++)
+		fixed += arg_cost(batch->fixed[i]);
+
+	batch->starts = malloc(sizeof(int) * (batch->nlist + 2));
+	CHECK(batch->starts != NULL);
+	batch->nchunks = 0;
+	size_t used = 0;
+	for (int i = 0; i < batch->nlist; i++) {
+		size_t cost = arg_cost(batch->list[i]);
+		if (batch->nchunks == 0 || fixed + used + cost > limit) {
+			batch->starts[batch->nchunks++] = i;
+			used = 0;
+		}
+		used += cost;
+	}
+	batch->starts[batch->nchunks] = batch->nlist;
+
+	for (int c = 0; c < batch->nchunks; c++) {
+		int n = batch->starts[c + 1] - batch->starts[c];
+		if (n > largest)
+			largest = n;
+	}
+	return largest;
+}
+
+// Fill in the argv for chunk 'c', returning its argc.
+static int chunk_argv(struct batch *batch, int c) {
+	int n = batch->starts[c + 1] - batch->starts[c];
+	memcpy(&batch->argv[batch->nfixed], &batch->list[batch->starts[c]], sizeof(char *) * n);
+	batch->argv[batch->nfixed + n] = NULL;
+	return batch->nfixed + n;
+}
+
+static int run_sequential(struct context *context, struct run_context *run_context, struct batch *batch) {
+	int rc = 0;
+	for (int c = 0; c < batch->nchunks; c++) {
+		int argc = chunk_argv(batch, c);
+		int chunk_rc = run_argv(context, run_context, batch->argv, argc);
+		if (rc == 0)
+			rc = chunk_rc;
+	}
+	return rc;
+}
+
+// Each chunk runs in a child of its own, which runs it as any other command
+// (a builtin, or through run_one_program with its deadline and spawnattr
+// settings), so that up to 'jobs' of them can be waited for together. The
+// command is the child's last, so it is exec'd in place rather than forked
+// again, and a chunk costs one process. One child_set holds them all, so each
+// chunk costs one pidfd_open however many times the shell waits.
+static int run_parallel(struct context *context, struct run_context *run_context, struct batch *batch, int jobs) {
+	pid_t *pids = malloc(sizeof(pid_t) * batch->nchunks);
+	int *rcs = malloc(sizeof(int) * batch->nchunks);
+	CHECK(pids != NULL && rcs != NULL);
+	struct child_set children;
+	int rc = 0;
+
+	child_set_init(&children, pids, batch->nchunks);
+	fflush(stdout);
+	for (int c = 0; c < batch->nchunks; c++) {
+		while (children.running >= jobs) {
+			int status;
+			int done = child_set_wait_any(&children, &status);
+			if (done < 0) {
+				// Nothing could be reaped: rather than go over the -P limit, run no more chunks.
+				fprintf(stderr, "[lsh_batch.c -> run_parallel()] cannot wait for a chunk; %d not run\n", batch->nchunks - c);
+				for (; c < batch->nchunks; c++)
+					rcs[c] = ECHILD;
+				goto reap;
+			}
+			rcs[done] = wait_status_to_rc(status);
+		}
+
+		int argc = chunk_argv(batch, c);
+		rcs[c] = 0;
+		pids[c] = fork();
+		if (pids[c] == -1) {
+			fprintf(stderr, "[lsh_batch.c -> run_parallel()] fork error: %d\n", errno);
+			rcs[c] = EAGAIN;
+		} else if (pids[c] == 0) {
+			run_context->reader = NULL;
+			run_context->exec_tail = 1;
+			exit(run_argv(context, run_context, batch->argv, argc));
+		} else {
+			child_set_add(&children, c);
+		}
+	}
+
+reap:
+	for (;;) {
+		int status;
+		int done = child_set_wait_any(&children, &status);
+		if (done < 0)
+			break;
+		rcs[done] = wait_status_to_rc(status);
+	}
+	child_set_destroy(&children);
+	for (int c = 0; c < batch->nchunks; c++) {
+		if (rc == 0)
+			rc = rcs[c];
+	}
+
+	free(rcs);
+	free(pids);
+	return rc;
+}
+
+// batch [-P N] command fixed-args... -- list...
+int handle_batch(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	struct batch batch = { 0 };
+	int jobs = 1;
+	int i = 1;
+
+	if (i < argc && strncmp(argv[i], "-P", 2) == 0) {
+		const char *n = argv[i][2] ? &argv[i][2] : i + 1 < argc ? argv[++i] : "";
+		char *end;
+		jobs = (int)strtol(n, &end, 10);
+		if (*n == 0 || *end != 0 || jobs <= 0) {
+			fprintf(stderr, "batch: -P needs a positive number of jobs\n");
+			return EINVAL;
+		}
+		i++;
+	}
+
+	int sep = i;
+	while (sep < argc && strcmp(argv[sep], "--") != 0)
+		sep++;
+	if (sep == i || sep == argc) {
+		fprintf(stderr, "usage: batch [-P N] command fixed-args... -- list...\n");
+		return EINVAL;
+	}
+
+	batch.fixed = &argv[i];
+	batch.nfixed = sep - i;
+	batch.list = &argv[sep + 1];
+	batch.nlist = argc - sep - 1;
+	// An empty list runs nothing.
+	if (batch.nlist == 0)
+		return 0;
+
+	// Room for the fixed arguments, the largest chunk and the NULL.
+	int largest = split_chunks(&batch, batch_limit(context));
+	batch.argv = malloc(sizeof(char *) * (batch.nfixed + largest + 1));
+	CHECK(batch.argv != NULL);
+	memcpy(batch.argv, batch.fixed, sizeof(char *) * batch.nfixed);
+
+	int rc = jobs > 1 && batch.nchunks > 1 ? run_parallel(context, run_context, &batch, jobs) : run_sequential(context, run_context, &batch);
+
+	free(batch.argv);
+	free(batch.starts);
+	return rc;
+}
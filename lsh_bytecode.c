@@ -0,0 +1,725 @@
+// The executor. Scripts are compiled to a flat array of instructions (struct
+// bytecode) and run by a threaded-dispatch interpreter: each instruction ends by
+// jumping straight to the handler of the next one, through a table of label
+// addresses, instead of walking the AST's pointers and testing which of a
+// statement's children is set.
+//
+// && and ||, conditionals and loops become jumps on the current return code;
+// sub-shells and loop bodies are compiled inline. Commands become spawn or
+// builtin instructions, with the argv of constant builtin calls built at compile
+// time. Pipelines, background jobs and 'pdo' loops, which fork, are single
+// instructions calling their handlers in lsh_ast.c.
+//
+// A command after which nothing but jumps can run before the end is marked as a
+// tail. In a forked child (a pipeline stage, a background job, a 'pdo' worker)
+// that would otherwise fork it and wait, the tail command is exec'd in place.
+//
+// Both the compiler and the interpreter use explicit, heap allocated stacks, so
+// nesting depth and chain length are bounded by memory, not the C stack. Code
+// is compiled on the first run of the node it starts at, whichever entry point
+// that is (a script, a pipeline stage's program, a background statement), and
+// kept on that node until the AST is freed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lsh_ast.h"
+
+// Computed goto is a GNU extension; other compilers get a switch.
+#if defined(__GNUC__)
+#define BC_THREADED	1
+#else
+#define BC_THREADED	0
+#endif
+
+enum bc_op {
+	OP_STATEMENT,		// A new statement starts; operand: the next one, for the lookahead.
+	OP_SIMPLE,		// rc = run the words program in operand.
+	OP_BUILTIN,		// rc = run the builtin with the prebuilt argv_buf in operand.
+	OP_CALL,		// rc = operand's run_fn (a pipeline).
+	OP_BACKGROUND,		// Run the statement in operand in the background; rc = 0.
+	OP_ASSIGN,		// rc = assign the var_assign in operand.
+	OP_PDO,			// rc = run the 'pdo' loop in operand.
+	OP_SET_RC,		// rc = arg.
+	OP_JUMP,		// Continue at arg.
+	OP_JUMP_IF_OK,		// Continue at arg if rc is 0.
+	OP_JUMP_IF_FAIL,	// Continue at arg if rc is not 0.
+	OP_FOR_BEGIN,		// Expand the values of the for loop in operand into loop 'slot'; rc = 0.
+	OP_FOR_NEXT,		// Set the loop variable to the next value of loop 'slot', or continue at arg when done.
+	OP_WHILE_BEGIN,		// Start while loop 'slot', attaching a reader to stdin for 'read'; rc = 0.
+	OP_WHILE_NEXT,		// Keep rc, from the body, as loop 'slot''s return code; continue at arg.
+	OP_WHILE_END,		// rc = loop 'slot''s return code; release its reader.
+	OP_TIME_BEGIN,		// Take time sample 'slot'.
+	OP_TIME_END,		// Report time sample 'slot' for the statement in operand.
+	OP_HALT,
+	OP_COUNT
+};
+
+static const char *const bc_op_names[OP_COUNT] = {
+	[OP_STATEMENT] = "STATEMENT",
+	[OP_SIMPLE] = "SIMPLE",
+	[OP_BUILTIN] = "BUILTIN",
+	[OP_CALL] = "CALL",
+	[OP_BACKGROUND] = "BACKGROUND",
+	[OP_ASSIGN] = "ASSIGN",
+	[OP_PDO] = "PDO",
+	[OP_SET_RC] = "SET_RC",
+	[OP_JUMP] = "JUMP",
+	[OP_JUMP_IF_OK] = "JUMP_IF_OK",
+	[OP_JUMP_IF_FAIL] = "JUMP_IF_FAIL",
+	[OP_FOR_BEGIN] = "FOR_BEGIN",
+	[OP_FOR_NEXT] = "FOR_NEXT",
+	[OP_WHILE_BEGIN] = "WHILE_BEGIN",
+	[OP_WHILE_NEXT] = "WHILE_NEXT",
+	[OP_WHILE_END] = "WHILE_END",
+	[OP_TIME_BEGIN] = "TIME_BEGIN",
+	[OP_TIME_END] = "TIME_END",
+	[OP_HALT] = "HALT",
+};
+
+struct bc_insn {
+	enum bc_op op;
+	// A jump target, or a value for OP_SET_RC.
+	int arg;
+	// A loop or time sample slot.
+	int slot;
+	// OP_SIMPLE: nothing but jumps can follow it before OP_HALT.
+	int tail;
+	const void *operand;
+};
+
+struct bytecode {
+	struct bc_insn *insns;
+	int ninsns;
+	int nloops;
+	int ntimes;
+};
+
+/******************************************************************************
+ * The compiler. Work items are popped off a stack; each one either emits an
+ * instruction, places a label, or pushes the items for its node's parts, last
+ * first. Jumps are emitted with label numbers, and patched to instruction
+ * indices once everything has been emitted.
+ ******************************************************************************/
+
+enum bc_task_kind {
+	T_SCRIPT,
+	T_SCRIPT_FROM,		// The statements of a script from 'node' on.
+	T_STATEMENT,
+	T_FG_STATEMENT,
+	T_FG_BODY,		// A foreground statement, less any 'time' prefix.
+	T_PROGRAM,
+	T_CONDITIONAL_PART,	// The parts of conditional 'aux' from 'node' on; 'label' is its end.
+	T_FOR_LOOP,
+	T_WHILE_LOOP,
+	T_EMIT,
+	T_LABEL,
+};
+
+struct bc_task {
+	enum bc_task_kind kind;
+	const void *node;
+	const void *aux;
+	int label;
+	struct bc_insn insn;
+};
+
+struct bc_compiler {
+	struct context *context;
+	struct bytecode *code;
+	int insn_capacity;
+	int *labels;
+	int nlabels;
+	int label_capacity;
+	struct bc_task *tasks;
+	int ntasks;
+	int task_capacity;
+};
+
+static int new_label(struct bc_compiler *c) {
+	if (c->nlabels == c->label_capacity) {
+		c->label_capacity = c->label_capacity ? c->label_capacity << 1 : 16;
+		c->labels = realloc(c->labels, sizeof(*c->labels) * c->label_capacity);
+		CHECK(c->labels != NULL);
+	}
+	c->labels[c->nlabels] = -1;
+	return c->nlabels++;
+}
+
+static struct bc_task *push_task(struct bc_compiler *c, enum bc_task_kind kind, const void *node) {
+	if (c->ntasks == c->task_capacity) {
+		c->task_capacity = c->task_capacity ? c->task_capacity << 1 : 64;
+		c->tasks = realloc(c->tasks, sizeof(*c->tasks) * c->task_capacity);
+		CHECK(c->tasks != NULL);
+	}
+	struct bc_task *t = &c->tasks[c->ntasks++];
+	memset(t, 0, sizeof(*t));
+	t->kind = kind;
+	t->node = node;
+	return t;
+}
+
+static void push_emit(struct bc_compiler *c, enum bc_op op, int arg, int slot, const void *operand) {
+	struct bc_task *t = push_task(c, T_EMIT, NULL);
+	t->insn.op = op;
+	t->insn.arg = arg;
+	t->insn.slot = slot;
+	t->insn.operand = operand;
+}
+
+static void push_label(struct bc_compiler *c, int label) {
+	push_task(c, T_LABEL, NULL)->label = label;
+}
+
+static void emit(struct bc_compiler *c, const struct bc_insn *insn) {
+	struct bytecode *code = c->code;
+	if (code->ninsns == c->insn_capacity) {
+		c->insn_capacity = c->insn_capacity ? c->insn_capacity << 1 : 64;
+		code->insns = realloc(code->insns, sizeof(*code->insns) * c->insn_capacity);
+		CHECK(code->insns != NULL);
+	}
+	code->insns[code->ninsns++] = *insn;
+}
+
+static int is_jump(enum bc_op op) {
+	return op == OP_JUMP || op == OP_JUMP_IF_OK || op == OP_JUMP_IF_FAIL || op == OP_FOR_NEXT || op == OP_WHILE_NEXT;
+}
+
+// Mark each OP_SIMPLE after which every path reaches OP_HALT through jumps alone. One pass from
+// the end back: forward jump targets are already known, and a backward jump is a loop's, which
+// runs its body again.
+static void mark_tails(struct bytecode *code) {
+	char *halts = calloc(code->ninsns + 1, 1);
+	for (int i = code->ninsns - 1; i >= 0; i--) {
+		struct bc_insn *insn = &code->insns[i];
+		int target = insn->arg > i && halts[insn->arg];
+		switch (insn->op) {
+			case OP_HALT:
+				halts[i] = 1;
+				break;
+			case OP_STATEMENT:
+				// What the new statement runs comes next.
+				halts[i] = halts[i + 1];
+				break;
+			case OP_JUMP:
+				halts[i] = target;
+				break;
+			case OP_JUMP_IF_OK:
+			case OP_JUMP_IF_FAIL:
+				halts[i] = target && halts[i + 1];
+				break;
+			case OP_SIMPLE:
+				insn->tail = halts[i + 1];
+				break;
+			default:
+				break;
+		}
+	}
+	free(halts);
+}
+
+static void compile_task(struct bc_compiler *c, const struct bc_task *t) {
+	switch (t->kind) {
+		case T_SCRIPT: {
+			const struct script *script = t->node;
+			// An empty script succeeds.
+			if (script == NULL || script->first == NULL)
+				push_emit(c, OP_SET_RC, 0, 0, NULL);
+			else
+				push_task(c, T_SCRIPT_FROM, script->first);
+			break;
+		}
+		case T_SCRIPT_FROM: {
+			const struct statement *statement = t->node;
+			if (statement->next)
+				push_task(c, T_SCRIPT_FROM, statement->next);
+			push_task(c, T_STATEMENT, statement);
+			push_emit(c, OP_STATEMENT, 0, 0, statement->next);
+			break;
+		}
+		case T_STATEMENT: {
+			const struct statement *statement = t->node;
+			if (statement->background)
+				push_emit(c, OP_BACKGROUND, 0, 0, statement);
+			else
+				push_task(c, T_FG_STATEMENT, statement);
+			break;
+		}
+		case T_FG_STATEMENT: {
+			const struct statement *statement = t->node;
+			if (statement->timed) {
+				int slot = c->code->ntimes++;
+				push_emit(c, OP_TIME_END, 0, slot, statement);
+				push_task(c, T_FG_BODY, statement);
+				push_emit(c, OP_TIME_BEGIN, 0, slot, NULL);
+			} else {
+				push_task(c, T_FG_BODY, statement);
+			}
+			break;
+		}
+		case T_FG_BODY: {
+			const struct statement *statement = t->node;
+			if (statement->conditional) {
+				struct bc_task *part = push_task(c, T_CONDITIONAL_PART, statement->conditional->first);
+				part->aux = statement->conditional;
+				part->label = new_label(c);
+			} else if (statement->program) {
+				push_task(c, T_PROGRAM, statement->program);
+			} else if (statement->for_loop) {
+				if (statement->for_loop->parallel)
+					push_emit(c, OP_PDO, 0, 0, statement->for_loop);
+				else
+					push_task(c, T_FOR_LOOP, statement->for_loop);
+			} else if (statement->while_loop) {
+				push_task(c, T_WHILE_LOOP, statement->while_loop);
+			} else if (statement->var_assign) {
+				push_emit(c, OP_ASSIGN, 0, 0, statement->var_assign);
+			} else {
+				push_emit(c, OP_SET_RC, -ENOSYS, 0, NULL);
+			}
+			break;
+		}
+		case T_PROGRAM: {
+			const struct program *program = t->node;
+			if (program->run_fn == run_and_programs || program->run_fn == run_or_programs) {
+				// && skips the rhs if the lhs failed, || if it succeeded.
+				int end = new_label(c);
+				push_label(c, end);
+				push_task(c, T_PROGRAM, program->rhs);
+				push_emit(c, program->run_fn == run_and_programs ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, end, 0, NULL);
+				push_task(c, T_PROGRAM, program->lhs);
+			} else if (program->run_fn) {
+				push_emit(c, OP_CALL, 0, 0, program);
+			} else if (program->script) {
+				push_task(c, T_SCRIPT, program->script);
+			} else {
+				struct argv_buf *argv = program_const_argv(c->context, program);
+				if (argv && argv->argc > 0 && is_builtin(argv->argv[0]))
+					push_emit(c, OP_BUILTIN, 0, 0, argv);
+				else
+					push_emit(c, OP_SIMPLE, 0, 0, program);
+			}
+			break;
+		}
+		case T_CONDITIONAL_PART: {
+			const struct conditional_part *cp = t->node;
+			const struct conditional *conditional = t->aux;
+			if (cp == NULL) {
+				// No predicate succeeded: the else block, if any, or the last predicate's return code.
+				push_label(c, t->label);
+				if (conditional->else_block)
+					push_task(c, T_SCRIPT, conditional->else_block);
+				else if (conditional->first == NULL)
+					push_emit(c, OP_SET_RC, 0, 0, NULL);
+				break;
+			}
+			int next = new_label(c);
+			struct bc_task *rest = push_task(c, T_CONDITIONAL_PART, cp->next);
+			rest->aux = conditional;
+			rest->label = t->label;
+			push_label(c, next);
+			push_emit(c, OP_JUMP, t->label, 0, NULL);
+			push_task(c, T_SCRIPT, cp->if_true_block);
+			push_emit(c, OP_JUMP_IF_FAIL, next, 0, NULL);
+			push_task(c, T_SCRIPT, cp->predicate);
+			break;
+		}
+		case T_FOR_LOOP: {
+			const struct for_loop *for_loop = t->node;
+			int slot = c->code->nloops++;
+			int top = new_label(c);
+			int end = new_label(c);
+			push_label(c, end);
+			push_emit(c, OP_JUMP, top, 0, NULL);
+			push_task(c, T_SCRIPT, for_loop->script);
+			push_emit(c, OP_FOR_NEXT, end, slot, for_loop);
+			push_label(c, top);
+			push_emit(c, OP_FOR_BEGIN, 0, slot, for_loop);
+			break;
+		}
+		case T_WHILE_LOOP: {
+			// The loop's return code is its body's last, or 0 if the body never ran.
+			const struct while_loop *while_loop = t->node;
+			int slot = c->code->nloops++;
+			int top = new_label(c);
+			int end = new_label(c);
+			push_emit(c, OP_WHILE_END, 0, slot, NULL);
+			push_label(c, end);
+			push_emit(c, OP_WHILE_NEXT, top, slot, NULL);
+			push_task(c, T_SCRIPT, while_loop->script);
+			push_emit(c, OP_JUMP_IF_FAIL, end, 0, NULL);
+			push_task(c, T_SCRIPT, while_loop->predicate);
+			push_label(c, top);
+			push_emit(c, OP_WHILE_BEGIN, 0, slot, NULL);
+			break;
+		}
+		case T_EMIT:
+			emit(c, &t->insn);
+			break;
+		case T_LABEL:
+			c->labels[t->label] = c->code->ninsns;
+			break;
+	}
+}
+
+static struct bytecode *compile(struct context *context, enum bytecode_root root, const void *node) {
+	struct bc_compiler c = { .context = context };
+	c.code = calloc(1, sizeof(*c.code));
+
+	switch (root) {
+		case BC_SCRIPT:
+			push_task(&c, T_SCRIPT, node);
+			break;
+		case BC_STATEMENT:
+			push_task(&c, T_STATEMENT, node);
+			break;
+		case BC_FG_STATEMENT:
+			push_task(&c, T_FG_STATEMENT, node);
+			break;
+		case BC_PROGRAM:
+			push_task(&c, T_PROGRAM, node);
+			break;
+		case BC_CONDITIONAL: {
+			const struct conditional *conditional = node;
+			struct bc_task *part = push_task(&c, T_CONDITIONAL_PART, conditional->first);
+			part->aux = conditional;
+			part->label = new_label(&c);
+			break;
+		}
+		case BC_FOR_LOOP: {
+			const struct for_loop *for_loop = node;
+			if (for_loop->parallel)
+				push_emit(&c, OP_PDO, 0, 0, for_loop);
+			else
+				push_task(&c, T_FOR_LOOP, for_loop);
+			break;
+		}
+	}
+
+	while (c.ntasks > 0) {
+		struct bc_task t = c.tasks[--c.ntasks];
+		compile_task(&c, &t);
+	}
+	struct bc_insn halt = { .op = OP_HALT };
+	emit(&c, &halt);
+
+	for (int i = 0; i < c.code->ninsns; i++) {
+		struct bc_insn *insn = &c.code->insns[i];
+		if (is_jump(insn->op))
+			insn->arg = c.labels[insn->arg];
+	}
+	mark_tails(c.code);
+
+	free(c.labels);
+	free(c.tasks);
+	return c.code;
+}
+
+void free_bytecode(struct bytecode *code) {
+	if (code == NULL)
+		return;
+	free(code->insns);
+	free(code);
+}
+
+// The code of 'node', run as 'root', compiled on its first run. A statement
+// that isn't backgrounded runs the same either way, so it has one copy.
+static const struct bytecode *node_bytecode(struct context *context, enum bytecode_root root, const void *node) {
+	struct bytecode **code = NULL;
+	switch (root) {
+		case BC_SCRIPT:
+			code = &((struct script *)node)->code;
+			break;
+		case BC_STATEMENT:
+			if (!((const struct statement *)node)->background)
+				return node_bytecode(context, BC_FG_STATEMENT, node);
+			code = &((struct statement *)node)->code;
+			break;
+		case BC_FG_STATEMENT:
+			code = &((struct statement *)node)->fg_code;
+			break;
+		case BC_PROGRAM:
+			code = &((struct program *)node)->code;
+			break;
+		case BC_CONDITIONAL:
+			code = &((struct conditional *)node)->code;
+			break;
+		case BC_FOR_LOOP:
+			code = &((struct for_loop *)node)->code;
+			break;
+	}
+	if (*code == NULL)
+		*code = compile(context, root, node);
+	return *code;
+}
+
+/******************************************************************************
+ * The interpreter.
+ ******************************************************************************/
+
+struct bc_loop {
+	// A for loop's values, generated as it goes (see lsh_range.c).
+	struct for_values *values;
+	// A while loop's return code so far, and the reader it attached, if any.
+	int rc;
+	struct line_reader *reader;
+};
+
+#if BC_THREADED
+#define TARGET(op)	L_##op
+#define DISPATCH()	goto *dispatch[pc->op]
+// Label addresses and 'goto *' are GNU C.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define TARGET(op)	case op
+#define DISPATCH()	continue
+#endif
+
+static int interpret(struct context *context, struct run_context *run_context, const struct bytecode *code) {
+	struct bc_loop *loops = calloc(code->nloops + 1, sizeof(*loops));
+	struct time_sample *samples = calloc(code->ntimes + 1, sizeof(*samples));
+	const struct bc_insn *pc = code->insns;
+	int rc = 0;
+	// Only a tail command may exec in place; anything else this runs must come back.
+	int exec_tail = run_context->exec_tail;
+	run_context->exec_tail = 0;
+
+#if BC_THREADED
+	static const void *const dispatch[OP_COUNT] = {
+		[OP_STATEMENT] = &&L_OP_STATEMENT,
+		[OP_SIMPLE] = &&L_OP_SIMPLE,
+		[OP_BUILTIN] = &&L_OP_BUILTIN,
+		[OP_CALL] = &&L_OP_CALL,
+		[OP_BACKGROUND] = &&L_OP_BACKGROUND,
+		[OP_ASSIGN] = &&L_OP_ASSIGN,
+		[OP_PDO] = &&L_OP_PDO,
+		[OP_SET_RC] = &&L_OP_SET_RC,
+		[OP_JUMP] = &&L_OP_JUMP,
+		[OP_JUMP_IF_OK] = &&L_OP_JUMP_IF_OK,
+		[OP_JUMP_IF_FAIL] = &&L_OP_JUMP_IF_FAIL,
+		[OP_FOR_BEGIN] = &&L_OP_FOR_BEGIN,
+		[OP_FOR_NEXT] = &&L_OP_FOR_NEXT,
+		[OP_WHILE_BEGIN] = &&L_OP_WHILE_BEGIN,
+		[OP_WHILE_NEXT] = &&L_OP_WHILE_NEXT,
+		[OP_WHILE_END] = &&L_OP_WHILE_END,
+		[OP_TIME_BEGIN] = &&L_OP_TIME_BEGIN,
+		[OP_TIME_END] = &&L_OP_TIME_END,
+		[OP_HALT] = &&L_OP_HALT,
+	};
+	DISPATCH();
+#else
+	for (;;) switch (pc->op) {
+#endif
+
+	TARGET(OP_STATEMENT):
+		context->lookahead = pc->operand;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_SIMPLE):
+		run_context->exec_tail = exec_tail && pc->tail;
+		rc = run_simple_program(context, pc->operand, run_context);
+		run_context->exec_tail = 0;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_BUILTIN): {
+		const struct argv_buf *argv = pc->operand;
+		rc = handle_builtin(context, run_context, argv->argv, argv->argc);
+		pc++;
+		DISPATCH();
+	}
+
+	TARGET(OP_CALL): {
+		const struct program *program = pc->operand;
+		rc = program->run_fn(context, program, run_context);
+		pc++;
+		DISPATCH();
+	}
+
+	TARGET(OP_BACKGROUND):
+		run_bg_statement(context, pc->operand, run_context);
+		rc = 0;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_ASSIGN):
+		rc = run_var_assign(context, pc->operand, run_context);
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_PDO):
+		rc = run_parallel_for_loop(context, pc->operand, run_context);
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_SET_RC):
+		rc = pc->arg;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_JUMP):
+		pc = code->insns + pc->arg;
+		DISPATCH();
+
+	TARGET(OP_JUMP_IF_OK):
+		pc = rc == 0 ? code->insns + pc->arg : pc + 1;
+		DISPATCH();
+
+	TARGET(OP_JUMP_IF_FAIL):
+		pc = rc != 0 ? code->insns + pc->arg : pc + 1;
+		DISPATCH();
+
+	TARGET(OP_FOR_BEGIN): {
+		const struct for_loop *for_loop = pc->operand;
+		loops[pc->slot].values = for_values_begin(context, for_loop->var_values);
+		// A failed '$((...))' in the values: no iterations, and the loop fails.
+		rc = loops[pc->slot].values == NULL;
+		pc++;
+		DISPATCH();
+	}
+
+	TARGET(OP_FOR_NEXT): {
+		const struct for_loop *for_loop = pc->operand;
+		struct bc_loop *loop = &loops[pc->slot];
+		const char *value = for_values_next(loop->values);
+		if (value == NULL) {
+			for_values_end(loop->values);
+			loop->values = NULL;
+			pc = code->insns + pc->arg;
+			DISPATCH();
+		}
+		context_set_var(context, for_loop->var_name->text, value);
+		pc++;
+		DISPATCH();
+	}
+
+	TARGET(OP_WHILE_BEGIN):
+		loops[pc->slot].rc = 0;
+		loops[pc->slot].reader = line_reader_attach(run_context);
+		rc = 0;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_WHILE_NEXT):
+		loops[pc->slot].rc = rc;
+		pc = code->insns + pc->arg;
+		DISPATCH();
+
+	TARGET(OP_WHILE_END):
+		line_reader_detach(run_context, loops[pc->slot].reader);
+		loops[pc->slot].reader = NULL;
+		rc = loops[pc->slot].rc;
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_TIME_BEGIN):
+		time_sample_begin(&samples[pc->slot]);
+		pc++;
+		DISPATCH();
+
+	TARGET(OP_TIME_END):
+		time_sample_report(context, pc->operand, &samples[pc->slot], rc);
+		pc++;
+		DISPATCH();
+
+#if !BC_THREADED
+	default:
+#endif
+	TARGET(OP_HALT):
+		goto done;
+
+#if !BC_THREADED
+	}
+#endif
+
+done:
+	run_context->exec_tail = exec_tail;
+	free(samples);
+	free(loops);
+	return rc;
+}
+
+#if BC_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+// Run 'node', of the kind given by 'root', compiling it first if this is its first run.
+int bytecode_run(struct context *context, struct run_context *run_context, enum bytecode_root root, const void *node) {
+	return interpret(context, run_context, node_bytecode(context, root, node));
+}
+
+static void print_words_inline(FILE *f, const struct words *words) {
+	for (const struct word *w = words ? words->first : NULL; w != NULL; w = w->next)
+		fprintf(f, " %s%s%s", w->is_arith ? "$((" : w->is_range ? "{" : w->is_var ? "$" : "", w->text, w->is_arith ? "))" : w->is_range ? "}" : "");
+}
+
+// Print a script's code, one instruction per line, for --print_bytecode.
+void print_bytecode(FILE *f, struct context *context, const struct script *script) {
+	const struct bytecode *code = node_bytecode(context, BC_SCRIPT, script);
+
+	fprintf(f, "bytecode: %d instructions, %d loop slots, %d time slots\n", code->ninsns, code->nloops, code->ntimes);
+	for (int i = 0; i < code->ninsns; i++) {
+		const struct bc_insn *insn = &code->insns[i];
+		// Operands line up in a column; an instruction without one ends at its name.
+		int has_operand = insn->op != OP_STATEMENT && insn->op != OP_BACKGROUND && insn->op != OP_HALT;
+		fprintf(f, "%04d  %-*s", i, has_operand ? 13 : 0, bc_op_names[insn->op]);
+		switch (insn->op) {
+			case OP_SIMPLE:
+				print_words_inline(f, ((const struct program *)insn->operand)->words);
+				if (insn->tail)
+					fprintf(f, " (tail)");
+				break;
+			case OP_BUILTIN: {
+				const struct argv_buf *argv = insn->operand;
+				for (int j = 0; j < argv->argc; j++)
+					fprintf(f, " %s", argv->argv[j]);
+				break;
+			}
+			case OP_CALL:
+				fprintf(f, " pipeline");
+				break;
+			case OP_ASSIGN: {
+				const struct var_assign *var_assign = insn->operand;
+				fprintf(f, " %s", var_assign->var_name);
+				print_words_inline(f, var_assign->var_value);
+				break;
+			}
+			case OP_PDO:
+			case OP_FOR_BEGIN: {
+				const struct for_loop *for_loop = insn->operand;
+				if (insn->op == OP_FOR_BEGIN)
+					fprintf(f, " slot %d", insn->slot);
+				fprintf(f, " %s in", for_loop->var_name->text);
+				print_words_inline(f, for_loop->var_values);
+				break;
+			}
+			case OP_SET_RC:
+				fprintf(f, " %d", insn->arg);
+				break;
+			case OP_JUMP:
+			case OP_JUMP_IF_OK:
+			case OP_JUMP_IF_FAIL:
+				fprintf(f, " -> %04d", insn->arg);
+				break;
+			case OP_FOR_NEXT:
+				fprintf(f, " slot %d, done -> %04d", insn->slot, insn->arg);
+				break;
+			case OP_WHILE_NEXT:
+				fprintf(f, " slot %d, -> %04d", insn->slot, insn->arg);
+				break;
+			case OP_WHILE_BEGIN:
+			case OP_WHILE_END:
+			case OP_TIME_BEGIN:
+			case OP_TIME_END:
+				fprintf(f, " slot %d", insn->slot);
+				break;
+			default:
+				break;
+		}
+		fputc('\n', f);
+	}
+}
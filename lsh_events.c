@@ -0,0 +1,507 @@
+// Child process event loop. Every wait in the executor goes through
+// wait_children() (or a child_set), which holds a pidfd for each child and multiplexes them with
+// epoll, so that a command can be given a deadline: SIGTERM when it expires,
+// then SIGKILL after a grace period. A child with a deadline leads a process
+// group of its own, and the signals go to the whole group, so that whatever it
+// has forked goes too.
+//
+// Background jobs are kept in the context's job table, which holds a pidfd for
+// each from when it starts in one epoll set of its own. Every wait_children()
+// watches that set as well, so that jobs which finish are reaped, and jobs past
+// their deadline signalled, whatever the shell is waiting for; 'wait' waits for
+// the rest.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "lsh_ast.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open	434
+#endif
+
+#define DEFAULT_KILL_GRACE_MS	2000
+#define MAX_EVENTS		16
+
+struct job {
+	pid_t pid;
+	// Its pidfd, or -1 if it can only be waited for by blocking.
+	int fd;
+	// When it is next signalled (now_ms()), or -1 if never.
+	long deadline;
+	long grace_ms;
+	int signalled;
+};
+
+struct job_table {
+	// The process the jobs are children of: one forked from it that inherits
+	// the table has no jobs, and starts a table of its own.
+	pid_t owner;
+	int epfd;
+	int n;
+	int capacity;
+	struct job *jobs;
+};
+
+// Set in a child once it leads a process group for a deadline: the children it
+// forks stay in the group, so that the deadline's signals reach them too.
+static int deadline_grouped;
+
+static int pidfd_open(pid_t pid) {
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Milliseconds on the monotonic clock.
+long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Parse a duration such as "10", "1.5", "250ms", "30s", "2m" or "1h" into
+// milliseconds. A bare number is seconds. Returns 0 on success. As 0 means no
+// deadline, a duration under a millisecond is rounded up to one rather than down.
+int parse_duration_ms(const char *s, long *ms) {
+	char *end;
+	double value = strtod(s, &end);
+	double scale = 1000;
+
+	if (end == s || value < 0)
+		return -1;
+	if (strcmp(end, "ms") == 0)
+		scale = 1;
+	else if (strcmp(end, "m") == 0)
+		scale = 60 * 1000;
+	else if (strcmp(end, "h") == 0)
+		scale = 60 * 60 * 1000;
+	else if (*end != 0 && strcmp(end, "s") != 0)
+		return -1;
+	double exact = value * scale;
+	if (exact >= LONG_MAX)
+		return -1;
+	*ms = (long)exact;
+	if (*ms == 0 && exact > 0)
+		*ms = 1;
+	return 0;
+}
+
+// Read a duration from a shell variable, or 'fallback' if it is unset or invalid.
+static long context_get_duration_ms(const struct context *context, const char *key, long fallback) {
+	const char *value = context_get_var(context, key);
+	long ms;
+	if (value == NULL || *value == 0 || parse_duration_ms(value, &ms) != 0)
+		return fallback;
+	return ms;
+}
+
+// The deadline for a command run with 'run_context': an enclosing 'timeout'
+// builtin takes precedence over the script-wide LSH_CMD_TIMEOUT. 0 means none.
+long command_timeout_ms(const struct context *context, const struct run_context *run_context) {
+	if (run_context && run_context->timeout_ms > 0)
+		return run_context->timeout_ms;
+	return context_get_duration_ms(context, "LSH_CMD_TIMEOUT", 0);
+}
+
+long command_kill_grace_ms(const struct context *context, const struct run_context *run_context) {
+	if (run_context && run_context->kill_grace_ms > 0)
+		return run_context->kill_grace_ms;
+	return context_get_duration_ms(context, "LSH_KILL_GRACE", DEFAULT_KILL_GRACE_MS);
+}
+
+// In a child forked to run a command under a deadline, start a process group
+// for it. A shell which is the terminal's foreground group keeps its children
+// there, so that they can still read the terminal and get its ^C.
+void deadline_group(const struct context *context, const struct run_context *run_context) {
+	if (deadline_grouped || command_timeout_ms(context, run_context) <= 0)
+		return;
+	if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp())
+		return;
+	if (setpgid(0, 0) == 0)
+		deadline_grouped = 1;
+}
+
+// Signal a child, and its process group if it leads one.
+static void signal_child(pid_t pid, int sig) {
+	kill(getpgid(pid) == pid ? -pid : pid, sig);
+}
+
+static void signal_remaining(const pid_t *pids, const int *fds, int n, int sig) {
+	for (int i = 0; i < n; i++) {
+		if (fds[i] >= 0)
+			signal_child(pids[i], sig);
+	}
+}
+
+static void free_job_fds(struct job_table *table) {
+	for (int i = 0; i < table->n; i++) {
+		if (table->jobs[i].fd >= 0)
+			close(table->jobs[i].fd);
+	}
+	if (table->epfd >= 0)
+		close(table->epfd);
+}
+
+void free_jobs(struct job_table *table) {
+	if (table == NULL)
+		return;
+	free_job_fds(table);
+	free(table->jobs);
+	free(table);
+}
+
+// The job table of this process, started if it has none.
+static struct job_table *job_table(struct context *context) {
+	struct job_table *table = context->jobs;
+	if (table && table->owner == getpid())
+		return table;
+	if (table == NULL) {
+		table = malloc(sizeof(*table));
+		CHECK(table != NULL);
+		table->capacity = 8;
+		table->jobs = malloc(sizeof(struct job) * table->capacity);
+		CHECK(table->jobs != NULL);
+		context->jobs = table;
+	} else {
+		// Inherited from the parent: its descriptors are copies, so closing them here leaves the
+		// parent's epoll set as it was.
+		free_job_fds(table);
+	}
+	table->owner = getpid();
+	table->epfd = epoll_create1(EPOLL_CLOEXEC);
+	table->n = 0;
+	return table;
+}
+
+// Add the background job 'pid', to be signalled 'timeout_ms' from now if that is positive.
+void jobs_add(struct context *context, pid_t pid, long timeout_ms, long grace_ms) {
+	struct job_table *table = job_table(context);
+	if (table->n == table->capacity) {
+		table->capacity <<= 1;
+		table->jobs = realloc(table->jobs, sizeof(struct job) * table->capacity);
+		CHECK(table->jobs != NULL);
+	}
+	struct job *job = &table->jobs[table->n];
+	job->pid = pid;
+	job->fd = table->epfd >= 0 ? pidfd_open(pid) : -1;
+	job->deadline = timeout_ms > 0 ? now_ms() + timeout_ms : -1;
+	job->grace_ms = grace_ms;
+	job->signalled = 0;
+	// Jobs are found by pid, as reaping one moves another into its place.
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)pid };
+	if (job->fd >= 0 && epoll_ctl(table->epfd, EPOLL_CTL_ADD, job->fd, &ev) != 0) {
+		close(job->fd);
+		job->fd = -1;
+	}
+	table->n++;
+}
+
+static void job_reaped(struct job_table *table, int i) {
+	if (table->jobs[i].fd >= 0) {
+		epoll_ctl(table->epfd, EPOLL_CTL_DEL, table->jobs[i].fd, NULL);
+		close(table->jobs[i].fd);
+	}
+	table->jobs[i] = table->jobs[--table->n];
+}
+
+// Reap the jobs that have finished and signal those past their deadline, without blocking.
+// Returns the milliseconds until the next deadline, or -1 if there is none.
+static long jobs_service(struct job_table *table) {
+	struct epoll_event events[MAX_EVENTS];
+	int nev;
+	while (table->n > 0 && (nev = epoll_wait(table->epfd, events, MAX_EVENTS, 0)) > 0) {
+		for (int e = 0; e < nev; e++) {
+			for (int i = 0; i < table->n; i++) {
+				int status;
+				if (table->jobs[i].pid != (pid_t)events[e].data.u32)
+					continue;
+				// Gone either way if waitpid fails.
+				if (waitpid(table->jobs[i].pid, &status, WNOHANG) != 0)
+					job_reaped(table, i);
+				break;
+			}
+		}
+		if (nev < MAX_EVENTS)
+			break;
+	}
+
+	long now = now_ms();
+	long next = -1;
+	for (int i = 0; i < table->n; i++) {
+		struct job *job = &table->jobs[i];
+		if (job->deadline < 0)
+			continue;
+		if (now >= job->deadline) {
+			// First ask nicely, then insist.
+			job->signalled = job->signalled ? SIGKILL : SIGTERM;
+			signal_child(job->pid, job->signalled);
+			job->deadline = job->signalled == SIGTERM ? now + job->grace_ms : -1;
+			if (job->deadline < 0)
+				continue;
+		}
+		if (next < 0 || job->deadline - now < next)
+			next = job->deadline - now;
+	}
+	return next;
+}
+
+// Wait for every background job ('wait'). Each is bounded by its own deadline.
+void jobs_wait(struct context *context) {
+	struct job_table *table = job_table(context);
+	while (table->n > 0) {
+		long next = jobs_service(table);
+		if (table->n == 0)
+			break;
+
+		// A job without a pidfd can only be waited for by blocking on it, as can any once the
+		// event loop fails.
+		int blocking = -1;
+		for (int i = 0; i < table->n && blocking < 0; i++) {
+			if (table->jobs[i].fd < 0)
+				blocking = i;
+		}
+		if (blocking < 0) {
+			struct epoll_event event;
+			if (epoll_wait(table->epfd, &event, 1, next > INT_MAX ? INT_MAX : (int)next) >= 0 || errno == EINTR)
+				continue;
+			printf("[lsh_events.c -> jobs_wait()] epoll_wait error: %d\n", errno);
+			blocking = 0;
+		}
+		int status;
+		while (waitpid(table->jobs[blocking].pid, &status, 0) < 0 && errno == EINTR)
+			;
+		job_reaped(table, blocking);
+	}
+}
+
+// Wait for all of the 'n' children in 'pids', storing each raw wait status in
+// 'statuses'. Entries with a pid <= 0 are skipped and get a status of -1. If
+// 'timeout_ms' is positive, children still running when it expires are sent
+// SIGTERM, and SIGKILL 'grace_ms' later. Returns 1 if the timeout expired, 0
+// otherwise.
+int wait_children(struct context *context, const pid_t *pids, int *statuses, int n, long timeout_ms, long grace_ms) {
+	return wait_children_idle(context, pids, statuses, n, timeout_ms, grace_ms, NULL);
+}
+
+// wait_children, calling 'idle(context)' once while the children run: after the
+// deadline is armed, so that whatever 'idle' does can't hold it off.
+int wait_children_idle(struct context *context, const pid_t *pids, int *statuses, int n, long timeout_ms, long grace_ms,
+		void (*idle)(struct context *context)) {
+	int *fds = malloc(sizeof(int) * (n + 1));
+	int remaining = 0;
+	int timed_out = 0;
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	// The job table's epoll set is watched as one more descriptor, with index n.
+	struct job_table *jobs = context ? context->jobs : NULL;
+	struct epoll_event jobs_ev = { .events = EPOLLIN, .data.u32 = (uint32_t)n };
+	if (jobs && (jobs->owner != getpid() || jobs->n == 0 || epfd < 0 || jobs->epfd < 0
+			|| epoll_ctl(epfd, EPOLL_CTL_ADD, jobs->epfd, &jobs_ev) != 0))
+		jobs = NULL;
+	long jobs_next = jobs ? jobs_service(jobs) : -1;
+
+	for (int i = 0; i < n; i++) {
+		statuses[i] = -1;
+		fds[i] = -1;
+		if (pids[i] <= 0 || epfd < 0)
+			continue;
+		fds[i] = pidfd_open(pids[i]);
+		if (fds[i] < 0)
+			continue;
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) != 0) {
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+		remaining++;
+	}
+
+	long deadline = timeout_ms > 0 ? now_ms() + timeout_ms : -1;
+	if (idle && remaining > 0)
+		idle(context);
+	while (remaining > 0) {
+		struct epoll_event events[MAX_EVENTS];
+		long wait_ms = -1;
+		if (deadline >= 0) {
+			long left = deadline - now_ms();
+			wait_ms = left > 0 ? left : 0;
+		}
+		if (jobs_next >= 0 && (wait_ms < 0 || jobs_next < wait_ms))
+			wait_ms = jobs_next;
+
+		int nev = epoll_wait(epfd, events, MAX_EVENTS, wait_ms > INT_MAX ? INT_MAX : (int)wait_ms);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("[lsh_events.c -> wait_children()] epoll_wait error: %d\n", errno);
+			break;
+		}
+		if (jobs)
+			jobs_next = jobs_service(jobs);
+		if (deadline >= 0 && now_ms() >= deadline) {
+			// Deadline expired: first ask nicely, then insist.
+			if (!timed_out) {
+				timed_out = 1;
+				signal_remaining(pids, fds, n, SIGTERM);
+				deadline = now_ms() + grace_ms;
+			} else {
+				signal_remaining(pids, fds, n, SIGKILL);
+				deadline = -1;
+			}
+		}
+		for (int e = 0; e < nev; e++) {
+			int i = (int)events[e].data.u32;
+			if (i == n || waitpid(pids[i], &statuses[i], WNOHANG) != pids[i])
+				continue;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], NULL);
+			close(fds[i]);
+			fds[i] = -1;
+			remaining--;
+		}
+	}
+
+	// Children without a pidfd (pidfd_open unsupported, or the loop failed)
+	// fall back to a blocking wait.
+	for (int i = 0; i < n; i++) {
+		if (pids[i] <= 0 || statuses[i] != -1)
+			continue;
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (waitpid(pids[i], &statuses[i], 0) != pids[i])
+			printf("[lsh_events.c -> wait_children()] waitpid error: %d\n", errno);
+	}
+
+	if (epfd >= 0)
+		close(epfd);
+	free(fds);
+	return timed_out;
+}
+
+// Start a set of up to 'capacity' children, to be waited for one at a time as
+// they exit. 'pids' is the caller's, all -1 until the children are added; the
+// set keeps one epoll instance, and a pidfd for each running child, until
+// child_set_destroy.
+void child_set_init(struct child_set *set, pid_t *pids, int capacity) {
+	set->pids = pids;
+	set->fds = malloc(sizeof(int) * (capacity + 1));
+	CHECK(set->fds != NULL);
+	set->capacity = capacity;
+	set->running = 0;
+	set->epfd = epoll_create1(EPOLL_CLOEXEC);
+	for (int i = 0; i < capacity; i++) {
+		pids[i] = -1;
+		set->fds[i] = -1;
+	}
+}
+
+// Add the child pids[i].
+void child_set_add(struct child_set *set, int i) {
+	set->fds[i] = set->epfd >= 0 ? pidfd_open(set->pids[i]) : -1;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+	if (set->fds[i] >= 0 && epoll_ctl(set->epfd, EPOLL_CTL_ADD, set->fds[i], &ev) != 0) {
+		close(set->fds[i]);
+		set->fds[i] = -1;
+	}
+	set->running++;
+}
+
+static void child_set_reaped(struct child_set *set, int i) {
+	if (set->fds[i] >= 0) {
+		epoll_ctl(set->epfd, EPOLL_CTL_DEL, set->fds[i], NULL);
+		close(set->fds[i]);
+		set->fds[i] = -1;
+	}
+	set->pids[i] = -1;
+	set->running--;
+}
+
+// Block until child i exits.
+static int child_set_wait_one(struct child_set *set, int i, int *status) {
+	while (waitpid(set->pids[i], status, 0) != set->pids[i]) {
+		if (errno == EINTR)
+			continue;
+		printf("[lsh_events.c -> child_set_wait_one()] waitpid error: %d\n", errno);
+		*status = 127 << 8;
+		break;
+	}
+	child_set_reaped(set, i);
+	return i;
+}
+
+// Wait for whichever child of the set exits first, storing its raw wait status
+// in '*status' and setting its pid to -1. Returns its index, or -1 if none is
+// running: while any is, one is always reaped, so that a caller keeping a limit
+// on how many run at once can rely on there being room afterwards.
+int child_set_wait_any(struct child_set *set, int *status) {
+	// A child without a pidfd can only be waited for by blocking on it.
+	for (int i = 0; i < set->capacity && set->running > 0; i++) {
+		if (set->pids[i] > 0 && set->fds[i] < 0)
+			return child_set_wait_one(set, i, status);
+	}
+
+	while (set->running > 0) {
+		struct epoll_event events[MAX_EVENTS];
+		int nev = epoll_wait(set->epfd, events, MAX_EVENTS, -1);
+		if (nev < 0 && errno == EINTR)
+			continue;
+		if (nev < 0) {
+			// Without the event loop, fall back to blocking on the first child still running.
+			printf("[lsh_events.c -> child_set_wait_any()] epoll_wait error: %d\n", errno);
+			for (int i = 0; i < set->capacity; i++) {
+				if (set->pids[i] > 0)
+					return child_set_wait_one(set, i, status);
+			}
+			return -1;
+		}
+		for (int e = 0; e < nev; e++) {
+			int i = (int)events[e].data.u32;
+			if (waitpid(set->pids[i], status, WNOHANG) == set->pids[i]) {
+				child_set_reaped(set, i);
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+void child_set_destroy(struct child_set *set) {
+	for (int i = 0; i < set->capacity; i++) {
+		if (set->fds[i] >= 0)
+			close(set->fds[i]);
+	}
+	if (set->epfd >= 0)
+		close(set->epfd);
+	free(set->fds);
+}
+
+// timeout [-k GRACE] DURATION command args...
+// Runs the command with a deadline. Like timeout(1), returns 124 if it expired.
+int handle_timeout(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	struct run_context timed = *run_context;
+	int i = 1;
+
+	if (i + 1 < argc && strcmp(argv[i], "-k") == 0) {
+		if (parse_duration_ms(argv[i + 1], &timed.kill_grace_ms) != 0) {
+			fprintf(stderr, "[lsh_events.c -> handle_timeout()] bad grace period '%s'\n", argv[i + 1]);
+			return EINVAL;
+		}
+		i += 2;
+	}
+	if (i + 1 >= argc || parse_duration_ms(argv[i], &timed.timeout_ms) != 0) {
+		fprintf(stderr, "usage: timeout [-k GRACE] DURATION command args...\n");
+		return EINVAL;
+	}
+	i++;
+
+	return run_argv(context, &timed, &argv[i], argc - i);
+}
@@ -0,0 +1,291 @@
+// Fan-out: one producer feeding several consumers.
+//
+//   producer |& { branch ; branch ; ... }
+//
+// Each statement between the braces is a branch, run in a child of its own
+// with its stdin connected to a copy of the producer's output; their output
+// goes wherever the fan-out's does, so 'a |& { b ; c } | d' works too. The
+// return code is that of the first branch, in order, that failed, or 0, and
+// when the fan-out runs in the shell (as the last stage of a pipeline) the
+// branches' return codes are also put in LSH_FANOUT_STATUS, space separated.
+//
+// The data isn't copied through the shell: tee() duplicates what is in the
+// input pipe into every branch's pipe but the last, and splice() then moves it
+// into the last one, so pages are only referenced, never copied. tee() can't
+// resume part way through, so if it comes up short for a branch whose pipe is
+// nearly full, the shell reads that round in and writes the rest out itself.
+// A branch that exits early is dropped, and the others carry on. Input that
+// isn't a pipe is copied with read() and write().
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lsh_ast.h"
+
+// The most a round moves; tee() and splice() stop at what the pipe holds.
+#define FANOUT_CHUNK	(1024 * 1024)
+
+struct fanout {
+	int in;
+	// The write end of each branch's pipe, -1 once the branch has gone.
+	int *outs;
+	int n;
+	// Scratch for each round: the live branches, and what tee() gave each.
+	int *live;
+	ssize_t *got;
+	// Buffer for rounds tee() didn't finish, and for input that isn't a pipe.
+	char *buf;
+};
+
+// Stop feeding branch 'i': it exited, or its pipe broke.
+static void drop_branch(struct fanout *fanout, int i) {
+	close(fanout->outs[i]);
+	fanout->outs[i] = -1;
+}
+
+// Write 'len' bytes to branch 'i', dropping it if it has gone.
+static void write_branch(struct fanout *fanout, int i, const char *data, size_t len) {
+	while (len > 0 && fanout->outs[i] >= 0) {
+		ssize_t n = write(fanout->outs[i], data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			drop_branch(fanout, i);
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+// Take exactly 'len' bytes out of the input into 'buf'.
+static int read_exactly(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Copy input that isn't a pipe, which tee() and splice() can't take.
+static void copy_all(struct fanout *fanout) {
+	for (;;) {
+		ssize_t n = read(fanout->in, fanout->buf, FANOUT_CHUNK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (int i = 0; i < fanout->n; i++)
+			write_branch(fanout, i, fanout->buf, n);
+	}
+}
+
+// One round: tee() up to FANOUT_CHUNK bytes to every live branch but the last,
+// then splice() the same bytes to the last. Returns 0 at the end of the input
+// or once every branch has gone.
+static int pump_round(struct fanout *fanout) {
+	int *live = fanout->live;
+	ssize_t *got = fanout->got;
+	int nlive = 0;
+
+	for (int i = 0; i < fanout->n; i++) {
+		if (fanout->outs[i] >= 0)
+			live[nlive++] = i;
+	}
+	if (nlive == 0)
+		return 0;
+
+	// The first tee() decides how much this round moves; the others are asked for just as much.
+	ssize_t len = FANOUT_CHUNK;
+	int short_tee = 0;
+	for (int j = 0; j < nlive - 1; j++) {
+		int i = live[j];
+		ssize_t n;
+		do {
+			n = tee(fanout->in, fanout->outs[i], len, 0);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			drop_branch(fanout, i);
+			got[i] = -1;
+			continue;
+		}
+		if (len == FANOUT_CHUNK) {
+			if (n == 0)
+				return 0;
+			len = n;
+		} else if (n < len) {
+			short_tee = 1;
+		}
+		got[i] = n;
+	}
+
+	int last = live[nlive - 1];
+	if (len == FANOUT_CHUNK) {
+		// Every other branch has gone: move whatever comes to the last one.
+		ssize_t n;
+		do {
+			n = splice(fanout->in, NULL, fanout->outs[last], NULL, FANOUT_CHUNK, 0);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0)
+			drop_branch(fanout, last);
+		return n != 0;
+	}
+
+	if (!short_tee) {
+		ssize_t moved = 0;
+		while (moved < len && fanout->outs[last] >= 0) {
+			ssize_t n = splice(fanout->in, NULL, fanout->outs[last], NULL, len - moved, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				drop_branch(fanout, last);
+				break;
+			}
+			moved += n;
+		}
+		if (moved == len)
+			return 1;
+		// The last branch went part way through; take the rest of the round out of the input.
+		if (read_exactly(fanout->in, fanout->buf, len - moved) != 0)
+			return 0;
+		return 1;
+	}
+
+	// Some branch's pipe took less than the rest: read the round in, and write each branch the part
+	// tee() didn't give it.
+	if (read_exactly(fanout->in, fanout->buf, len) != 0)
+		return 0;
+	for (int j = 0; j < nlive - 1; j++) {
+		int i = live[j];
+		if (got[i] >= 0 && got[i] < len)
+			write_branch(fanout, i, fanout->buf + got[i], len - got[i]);
+	}
+	write_branch(fanout, last, fanout->buf, len);
+	return 1;
+}
+
+// Run each branch of the fan-out 'program' (a statement of program->script),
+// feeding all of them the fan-out's stdin.
+int run_fanout_program(struct context *context, const struct program *program, struct run_context *run_context) {
+	struct fanout fanout = { 0 };
+	int n = 0;
+	int rc = 0;
+
+	for (const struct statement *s = program->script ? program->script->first : NULL; s != NULL; s = s->next)
+		n++;
+	if (n == 0)
+		return 0;
+
+	fanout.in = run_context->stdin_fd >= 0 ? run_context->stdin_fd : STDIN_FILENO;
+	fanout.outs = malloc(sizeof(int) * n);
+	fanout.n = n;
+	fanout.live = malloc(sizeof(int) * n);
+	fanout.got = malloc(sizeof(ssize_t) * n);
+	fanout.buf = malloc(FANOUT_CHUNK);
+	pid_t *pids = malloc(sizeof(pid_t) * n);
+	int *statuses = malloc(sizeof(int) * n);
+
+	// Don't let the children inherit (and later flush) buffered output.
+	fflush(stdout);
+	const struct statement *statement = program->script->first;
+	for (int i = 0; i < n; i++, statement = statement->next) {
+		int pipefd[2];
+		fanout.outs[i] = -1;
+		pids[i] = -1;
+		if (pipe(pipefd) != 0) {
+			fprintf(stderr, "[lsh_fanout.c -> run_fanout_program()] pipe error: %d\n", errno);
+			rc = 1;
+			continue;
+		}
+
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			fprintf(stderr, "[lsh_fanout.c -> run_fanout_program()] fork error: %d\n", errno);
+			close(pipefd[0]);
+			close(pipefd[1]);
+			rc = 1;
+		} else if (pids[i] == 0) {
+			deadline_group(context, run_context);
+			// Only this branch's pipe: the others' write ends would keep them from seeing EOF.
+			for (int j = 0; j < i; j++) {
+				if (fanout.outs[j] >= 0)
+					close(fanout.outs[j]);
+			}
+			close(pipefd[1]);
+			dup2(pipefd[0], STDIN_FILENO);
+			close(pipefd[0]);
+			if (fanout.in != STDIN_FILENO)
+				close(fanout.in);
+			if (run_context->stdout_fd >= 0)
+				dup2(run_context->stdout_fd, STDOUT_FILENO);
+
+			struct run_context branch_context = *run_context;
+			branch_context.stdin_fd = -1;
+			branch_context.stdout_fd = -1;
+			branch_context.reader = NULL;
+			branch_context.exec_tail = 1;
+			int branch_rc = run_statement(context, statement, &branch_context);
+			fflush(stdout);
+			exit(branch_rc);
+		} else {
+			close(pipefd[0]);
+			fanout.outs[i] = pipefd[1];
+		}
+	}
+
+	// A branch that exits early must fail the shell's writes with EPIPE, not kill it.
+	struct sigaction ignore = { .sa_handler = SIG_IGN }, saved;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &saved);
+
+	struct stat st;
+	if (fstat(fanout.in, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		while (pump_round(&fanout))
+			;
+	} else {
+		copy_all(&fanout);
+	}
+	for (int i = 0; i < n; i++) {
+		if (fanout.outs[i] >= 0)
+			close(fanout.outs[i]);
+	}
+	sigaction(SIGPIPE, &saved, NULL);
+
+	// The deadline bounds the branches together; like timeout(1), an expired one returns 124.
+	int timed_out = wait_children(context, pids, statuses, n, command_timeout_ms(context, run_context), command_kill_grace_ms(context, run_context));
+
+	// "0 1 0": each branch's return code, in order.
+	char *status = malloc((size_t)n * 12 + 1);
+	char *p = status;
+	for (int i = 0; i < n; i++) {
+		int branch_rc = pids[i] > 0 ? wait_status_to_rc(statuses[i]) : 1;
+		p += sprintf(p, "%s%d", i ? " " : "", branch_rc);
+		if (rc == 0)
+			rc = branch_rc;
+	}
+	if (timed_out)
+		rc = 124;
+	context_set_var(context, "LSH_FANOUT_STATUS", status);
+
+	free(status);
+	free(statuses);
+	free(pids);
+	free(fanout.buf);
+	free(fanout.got);
+	free(fanout.live);
+	free(fanout.outs);
+	return rc;
+}
@@ -0,0 +1,426 @@
+// Launch attributes: CPU affinity, niceness, I/O priority and cgroup v2
+// placement applied to child processes at spawn time. These are configured
+// with the 'spawnattr' builtin, either shell-wide or as a prefix for a single
+// command.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+
+#include "lsh_ast.h"
+
+// From linux/ioprio.h, which is not always installed.
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+
+#define DEFAULT_CGROUP_ROOT	"/sys/fs/cgroup"
+#define MAX_LIMIT_UNDOS		8
+
+struct launch_attrs {
+	int has_cpus;
+	cpu_set_t cpus;
+	int has_nice;
+	int nice;
+	// 0 when unset, otherwise (class << IOPRIO_CLASS_SHIFT) | level.
+	int ioprio;
+	// Absolute path of the cgroup v2 directory children are moved into, or NULL.
+	char *cgroup_dir;
+	// Pin 'pdo' workers round-robin across the allowed cpus.
+	int spread;
+};
+
+// cpu.max and memory.max are files of the cgroup, shared by everything in it, so
+// 'spawnattr cgroup g cpu.max ... -- cmd' keeps their previous values to put back
+// once the command is done.
+struct limit_undo {
+	char *dir;
+	const char *name;
+	char value[128];
+};
+
+struct limit_undos {
+	int n;
+	struct limit_undo undo[MAX_LIMIT_UNDOS];
+};
+
+void free_launch_attrs(struct launch_attrs *launch_attrs) {
+	if (launch_attrs == NULL)
+		return;
+	free(launch_attrs->cgroup_dir);
+	free(launch_attrs);
+}
+
+static struct launch_attrs *copy_launch_attrs(const struct launch_attrs *launch_attrs) {
+	struct launch_attrs *copy = calloc(1, sizeof(*copy));
+	if (launch_attrs != NULL) {
+		*copy = *launch_attrs;
+		if (launch_attrs->cgroup_dir)
+			copy->cgroup_dir = strdup(launch_attrs->cgroup_dir);
+	}
+	return copy;
+}
+
+// Parse a cpu list such as "0-3,6,8-9".
+static int parse_cpu_list(const char *s, cpu_set_t *set) {
+	CPU_ZERO(set);
+	while (*s) {
+		char *end;
+		long lo = strtol(s, &end, 10);
+		long hi = lo;
+		if (end == s || lo < 0)
+			return -1;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				return -1;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = lo; cpu <= hi; cpu++)
+			CPU_SET(cpu, set);
+		if (*end == ',')
+			end++;
+		else if (*end != 0)
+			return -1;
+		s = end;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Parse CLASS[:LEVEL] where CLASS is rt, be, idle or 1-3.
+static int parse_ioprio(const char *s) {
+	static const char *classes[] = { "none", "rt", "be", "idle" };
+	int class = -1;
+	int level = 4;
+	const char *colon = strchr(s, ':');
+	size_t len = colon ? (size_t)(colon - s) : strlen(s);
+
+	for (int i = 1; i < 4; i++) {
+		if (strlen(classes[i]) == len && strncmp(s, classes[i], len) == 0)
+			class = i;
+	}
+	if (class < 0 && len == 1 && s[0] >= '1' && s[0] <= '3')
+		class = s[0] - '0';
+	if (class < 0)
+		return -1;
+	if (colon) {
+		char *end;
+		level = (int)strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != 0 || level < 0 || level > 7)
+			return -1;
+	}
+	// The idle class has no levels.
+	if (class == 3)
+		level = 0;
+	return (class << IOPRIO_CLASS_SHIFT) | level;
+}
+
+static int write_file(const char *path, const char *value) {
+	int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ssize_t len = (ssize_t)strlen(value);
+	ssize_t n = write(fd, value, len);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return n == len ? 0 : -1;
+}
+
+// Write 'value' into the file 'name' inside the cgroup directory.
+static int cgroup_write(const char *dir, const char *name, const char *value) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (write_file(path, value) != 0) {
+		fprintf(stderr, "[lsh_launch.c -> cgroup_write()] writing '%s' to %s error: %d (%s)\n", value, path, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Read the file 'name' inside the cgroup directory into 'value', without its newline.
+static int cgroup_read(const char *dir, const char *name, char *value, size_t size) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t n = fd < 0 ? -1 : read(fd, value, size - 1);
+	if (n < 0) {
+		fprintf(stderr, "[lsh_launch.c -> cgroup_read()] reading %s error: %d (%s)\n", path, errno, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	value[n] = 0;
+	value[strcspn(value, "\n")] = 0;
+	return 0;
+}
+
+// Set a limit of the cgroup, first saving its value in 'undos' if there is one.
+static int cgroup_set_limit(const char *dir, const char *name, const char *value, struct limit_undos *undos) {
+	if (undos) {
+		if (undos->n == MAX_LIMIT_UNDOS) {
+			fprintf(stderr, "[lsh_launch.c -> cgroup_set_limit()] too many limits for one command\n");
+			return -1;
+		}
+		struct limit_undo *undo = &undos->undo[undos->n];
+		if (cgroup_read(dir, name, undo->value, sizeof(undo->value)) != 0)
+			return -1;
+		undo->dir = strdup(dir);
+		undo->name = name;
+		undos->n++;
+	}
+	return cgroup_write(dir, name, value);
+}
+
+// Put back the limits in 'undos', latest first, so a limit set twice ends up as it started.
+static void cgroup_undo_limits(struct limit_undos *undos) {
+	while (undos->n > 0) {
+		struct limit_undo *undo = &undos->undo[--undos->n];
+		cgroup_write(undo->dir, undo->name, undo->value);
+		free(undo->dir);
+	}
+}
+
+// Create the cgroup 'name' below the cgroup root (LSH_CGROUP_ROOT, or the
+// unified hierarchy mount point). Each directory created on the way to it
+// enables the cpu and memory controllers for the next level down, so that the
+// cgroup gets cpu.max and memory.max. The root and any existing ancestors are
+// left alone: turning controllers on there would change the rest of the
+// hierarchy, so they must already delegate them.
+static char *cgroup_create(const struct context *context, const char *name) {
+	const char *root = context_get_var(context, "LSH_CGROUP_ROOT");
+	char path[PATH_MAX];
+
+	if (root == NULL || *root == 0)
+		root = DEFAULT_CGROUP_ROOT;
+	if (name[0] == '/' || strstr(name, "..") != NULL) {
+		fprintf(stderr, "[lsh_launch.c -> cgroup_create()] cgroup name '%s' must be relative to %s\n", name, root);
+		return NULL;
+	}
+	if (snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path)) {
+		fprintf(stderr, "[lsh_launch.c -> cgroup_create()] cgroup path %s/%s too long\n", root, name);
+		return NULL;
+	}
+
+	// mkdir -p.
+	for (char *p = path + strlen(root) + 1; ; p++) {
+		if (*p != '/' && *p != 0)
+			continue;
+		char c = *p;
+		*p = 0;
+		int created = mkdir(path, 0755) == 0;
+		if (!created && errno != EEXIST) {
+			fprintf(stderr, "[lsh_launch.c -> cgroup_create()] mkdir %s error: %d (%s)\n", path, errno, strerror(errno));
+			return NULL;
+		}
+		// cgroup_write reports a controller this directory's parent doesn't delegate.
+		if (created && c != 0) {
+			cgroup_write(path, "cgroup.subtree_control", "+cpu");
+			cgroup_write(path, "cgroup.subtree_control", "+memory");
+		}
+		*p = c;
+		if (c == 0)
+			break;
+	}
+	return strdup(path);
+}
+
+static void print_launch_attrs(FILE *f, const struct launch_attrs *attrs) {
+	if (attrs == NULL)
+		return;
+	if (attrs->has_cpus) {
+		fprintf(f, "cpus ");
+		int first = 1;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &attrs->cpus)) {
+				fprintf(f, "%s%d", first ? "" : ",", cpu);
+				first = 0;
+			}
+		}
+		fprintf(f, "\n");
+	}
+	if (attrs->has_nice)
+		fprintf(f, "nice %d\n", attrs->nice);
+	if (attrs->ioprio)
+		fprintf(f, "ionice %d:%d\n", attrs->ioprio >> IOPRIO_CLASS_SHIFT, attrs->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+	if (attrs->cgroup_dir)
+		fprintf(f, "cgroup %s\n", attrs->cgroup_dir);
+	fprintf(f, "spread %d\n", attrs->spread);
+}
+
+// Apply a single 'key value' setting to 'attrs'. Cgroup limits are written at
+// once, saving the old values in 'undos' unless it is NULL. Returns 0 on success.
+static int parse_launch_attr(const struct context *context, struct launch_attrs *attrs, const char *key, const char *value,
+		struct limit_undos *undos) {
+#define KEY_IS(k)	(strcmp(key, k) == 0)
+
+	if (KEY_IS("cpus")) {
+		if (strcmp(value, "-") == 0) {
+			attrs->has_cpus = 0;
+		} else if (parse_cpu_list(value, &attrs->cpus) == 0) {
+			attrs->has_cpus = 1;
+		} else {
+			return -1;
+		}
+	} else if (KEY_IS("nice")) {
+		char *end;
+		long nice = strtol(value, &end, 10);
+		if (end == value || *end != 0 || nice < -20 || nice > 19)
+			return -1;
+		attrs->has_nice = 1;
+		attrs->nice = (int)nice;
+	} else if (KEY_IS("ionice")) {
+		int ioprio = parse_ioprio(value);
+		if (ioprio < 0)
+			return -1;
+		attrs->ioprio = ioprio;
+	} else if (KEY_IS("cgroup")) {
+		free(attrs->cgroup_dir);
+		attrs->cgroup_dir = NULL;
+		if (strcmp(value, "-") != 0 && (attrs->cgroup_dir = cgroup_create(context, value)) == NULL)
+			return -1;
+	} else if (KEY_IS("cpu.max")) {
+		// QUOTA[/PERIOD] in microseconds, or 'max'.
+		char buf[64];
+		if (attrs->cgroup_dir == NULL)
+			return -1;
+		snprintf(buf, sizeof(buf), "%s", value);
+		char *slash = strchr(buf, '/');
+		if (slash)
+			*slash = ' ';
+		return cgroup_set_limit(attrs->cgroup_dir, "cpu.max", buf, undos);
+	} else if (KEY_IS("memory.max")) {
+		if (attrs->cgroup_dir == NULL)
+			return -1;
+		return cgroup_set_limit(attrs->cgroup_dir, "memory.max", value, undos);
+	} else if (KEY_IS("spread")) {
+		attrs->spread = strcmp(value, "0") != 0 && strcmp(value, "off") != 0;
+	} else {
+		return -1;
+	}
+	return 0;
+#undef KEY_IS
+}
+
+// spawnattr [reset] [KEY VALUE...] [-- command args...]
+// Keys are cpus, nice, ionice, cgroup, cpu.max, memory.max and spread.
+// With no command, the settings apply to every child spawned afterwards. With
+// a command, they apply to that command only: cpu.max and memory.max, which are
+// the cgroup's, are put back as they were once it has finished. (While it runs
+// they apply to anything else in the cgroup too.)
+int handle_spawnattr(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	struct launch_attrs *saved = NULL;
+	struct limit_undos undos = { 0 };
+	int cmd = 0;
+	int rc = 0;
+
+	if (argc == 1) {
+		print_launch_attrs(stdout, context->launch_attrs);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			cmd = i + 1;
+			break;
+		}
+	}
+	if (cmd) {
+		saved = context->launch_attrs;
+		context->launch_attrs = copy_launch_attrs(saved);
+	} else if (context->launch_attrs == NULL) {
+		context->launch_attrs = copy_launch_attrs(NULL);
+	}
+
+	int end = cmd ? cmd - 1 : argc;
+	for (int i = 1; i < end; i++) {
+		if (strcmp(argv[i], "reset") == 0) {
+			free_launch_attrs(context->launch_attrs);
+			context->launch_attrs = copy_launch_attrs(NULL);
+			continue;
+		}
+		if (i + 1 >= end || parse_launch_attr(context, context->launch_attrs, argv[i], argv[i + 1], cmd ? &undos : NULL) != 0) {
+			fprintf(stderr, "[lsh_launch.c -> handle_spawnattr()] bad attribute '%s'\n", argv[i]);
+			rc = EINVAL;
+			goto out;
+		}
+		i++;
+	}
+
+	if (cmd && cmd < argc) {
+		// The limits can only be put back if the shell is still there afterwards.
+		int exec_tail = run_context->exec_tail;
+		if (undos.n > 0)
+			run_context->exec_tail = 0;
+		rc = run_argv(context, run_context, &argv[cmd], argc - cmd);
+		run_context->exec_tail = exec_tail;
+	}
+
+out:
+	cgroup_undo_limits(&undos);
+	if (cmd) {
+		free_launch_attrs(context->launch_attrs);
+		context->launch_attrs = saved;
+	}
+	return rc;
+}
+
+// Pin the calling process to the 'slot'th cpu (modulo the count) of 'allowed'.
+static void pin_round_robin(const cpu_set_t *allowed, int slot) {
+	int count = CPU_COUNT(allowed);
+	if (count == 0)
+		return;
+	int n = slot % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, allowed) && n-- == 0) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			if (sched_setaffinity(0, sizeof(one), &one) != 0)
+				fprintf(stderr, "[lsh_launch.c -> pin_round_robin()] sched_setaffinity error: %d\n", errno);
+			return;
+		}
+	}
+}
+
+// Called in a freshly forked child, before it execs or runs a sub-script.
+// 'pdo_slot' is the iteration index of a parallel for loop worker, or -1.
+void apply_launch_attrs(const struct context *context, int pdo_slot) {
+	const struct launch_attrs *attrs = context->launch_attrs;
+	if (attrs == NULL)
+		return;
+
+	// Join the cgroup first; its cpuset may restrict the affinity set below.
+	if (attrs->cgroup_dir)
+		cgroup_write(attrs->cgroup_dir, "cgroup.procs", "0");
+
+	if (pdo_slot >= 0 && attrs->spread) {
+		cpu_set_t allowed;
+		if (attrs->has_cpus) {
+			allowed = attrs->cpus;
+		} else if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+			CPU_ZERO(&allowed);
+		}
+		pin_round_robin(&allowed, pdo_slot);
+	} else if (attrs->has_cpus) {
+		if (sched_setaffinity(0, sizeof(attrs->cpus), &attrs->cpus) != 0)
+			fprintf(stderr, "[lsh_launch.c -> apply_launch_attrs()] sched_setaffinity error: %d\n", errno);
+	}
+
+	if (attrs->has_nice && setpriority(PRIO_PROCESS, 0, attrs->nice) != 0)
+		fprintf(stderr, "[lsh_launch.c -> apply_launch_attrs()] setpriority error: %d\n", errno);
+
+	if (attrs->ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, attrs->ioprio) != 0)
+		fprintf(stderr, "[lsh_launch.c -> apply_launch_attrs()] ioprio_set error: %d\n", errno);
+}
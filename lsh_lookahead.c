@@ -0,0 +1,233 @@
+// Speculative lookahead. Once a child has been forked, the shell has nothing to
+// do until it exits, so it looks at the next few statements of the script and
+// gets them ready to run:
+//
+//  - commands without variables are expanded once and their argv kept on the
+//    program node (struct program's const_argv), so they aren't expanded again;
+//  - their argv[0] is resolved on PATH and cached, so the child can exec it
+//    directly instead of trying each PATH entry in turn;
+//  - the binaries, and any arguments that name regular files, are prefetched
+//    into the page cache with posix_fadvise(POSIX_FADV_WILLNEED), which starts
+//    the reads without waiting for them. Only regular files are opened: opening
+//    a device, a FIFO or an automount point can do something by itself.
+//
+// Each statement is looked at once, and the work stops after LOOKAHEAD_MAX_MS
+// so that the command it runs alongside isn't kept waiting for its parent.
+// Setting LSH_LOOKAHEAD=0 turns this off.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <search.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "lsh_ast.h"
+
+// How many statements ahead to look, and how many commands to prepare at most.
+#define LOOKAHEAD_STATEMENTS	4
+#define LOOKAHEAD_PROGRAMS	16
+// Arguments per command checked for files, and the most of a file to prefetch.
+#define LOOKAHEAD_ARGS		8
+#define LOOKAHEAD_MAX_BYTES	(64L << 20)
+// The most time one lookahead spends, checked between commands.
+#define LOOKAHEAD_MAX_MS	5
+
+struct path_entry {
+	char *name;
+	// NULL if 'name' isn't on PATH.
+	char *path;
+};
+
+static int path_entry_compare(const void *_a, const void *_b) {
+	const struct path_entry *a = _a;
+	const struct path_entry *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+static void free_path_entry(void *_entry) {
+	struct path_entry *entry = _entry;
+	free(entry->name);
+	free(entry->path);
+	free(entry);
+}
+
+void free_lookahead_cache(struct context *context) {
+	tdestroy(context->path_cache, free_path_entry);
+	context->path_cache = NULL;
+	free(context->path_cache_key);
+	context->path_cache_key = NULL;
+}
+
+// The cache is only valid for the PATH it was filled with. The child execs with
+// the process environment, so that is the PATH used here too.
+static int path_cache_valid(struct context *context) {
+	const char *path = getenv("PATH");
+	if (path == NULL)
+		return 0;
+	if (context->path_cache_key && strcmp(context->path_cache_key, path) == 0)
+		return 1;
+	free_lookahead_cache(context);
+	context->path_cache_key = strdup(path);
+	return 1;
+}
+
+// Where a command name resolves on PATH, if the lookahead has already found it.
+const char *lookahead_cached_path(struct context *context, const char *name) {
+	struct path_entry key = { .name = (char *)name };
+
+	if (strchr(name, '/') || !path_cache_valid(context))
+		return NULL;
+	void *t = tfind(&key, &context->path_cache, path_entry_compare);
+	return t ? (*(struct path_entry **)t)->path : NULL;
+}
+
+// Search PATH the way execvp does, and remember the result. Relative PATH
+// entries depend on the working directory, so commands found there (or not
+// found at all past one) aren't cached.
+static const char *resolve_path(struct context *context, const char *name) {
+	struct path_entry key = { .name = (char *)name };
+	char candidate[PATH_MAX];
+	char *found = NULL;
+
+	if (strchr(name, '/') || !path_cache_valid(context))
+		return NULL;
+	void *t = tfind(&key, &context->path_cache, path_entry_compare);
+	if (t)
+		return (*(struct path_entry **)t)->path;
+
+	for (const char *dir = context->path_cache_key; ; ) {
+		const char *end = strchrnul(dir, ':');
+		if (*dir != '/')
+			return NULL;
+		struct stat st;
+		snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(end - dir), dir, name);
+		if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+			found = strdup(candidate);
+			break;
+		}
+		if (*end == 0)
+			break;
+		dir = end + 1;
+	}
+
+	struct path_entry *entry = malloc(sizeof(*entry));
+	entry->name = strdup(name);
+	entry->path = found;
+	tsearch(entry, &context->path_cache, path_entry_compare);
+	return found;
+}
+
+// Start reading a regular file into the page cache. Anything else isn't opened;
+// O_NONBLOCK still guards against the path being replaced by a FIFO meanwhile.
+static void prefetch_file(const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return;
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		posix_fadvise(fd, 0, st.st_size < LOOKAHEAD_MAX_BYTES ? st.st_size : LOOKAHEAD_MAX_BYTES, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+// The argv of a words program without variables, expanded once and kept on the
+// program. NULL if the program's argv depends on variables or arithmetic.
+struct argv_buf *program_const_argv(struct context *context, const struct program *program) {
+	if (program->const_argv)
+		return program->const_argv;
+	for (const struct word *word = program->words->first; word != NULL; word = word->next) {
+		if (word->is_var || word->is_arith)
+			return NULL;
+	}
+	((struct program *)program)->const_argv = make_argv(context, program->words);
+	return program->const_argv;
+}
+
+static void prefetch_program(struct context *context, const struct program *program) {
+	struct argv_buf *argv = program_const_argv(context, program);
+	if (argv == NULL || argv->argc == 0 || is_builtin(argv->argv[0]))
+		return;
+
+	const char *path = strchr(argv->argv[0], '/') ? argv->argv[0] : resolve_path(context, argv->argv[0]);
+	if (path)
+		prefetch_file(path);
+	for (int i = 1; i < argv->argc && i <= LOOKAHEAD_ARGS; i++) {
+		if (argv->argv[i][0] != '-')
+			prefetch_file(argv->argv[i]);
+	}
+}
+
+static void prefetch_statement(struct context *context, const struct statement *statement, int *budget);
+
+static void prefetch_script(struct context *context, const struct script *script, int *budget) {
+	if (script && script->first)
+		prefetch_statement(context, script->first, budget);
+}
+
+// Prepare the commands a statement runs first: each stage of a pipeline or
+// chain, the first command of a sub-shell, and the first predicate and branch
+// of a conditional, the body of a for loop and the predicate and body of a
+// while loop. '*budget' bounds the work.
+static void prefetch_statement(struct context *context, const struct statement *statement, int *budget) {
+	const struct program *pending[LOOKAHEAD_PROGRAMS];
+	int npending = 0;
+
+	if (statement->prefetched || *budget <= 0)
+		return;
+	((struct statement *)statement)->prefetched = 1;
+	(*budget)--;
+
+	if (statement->conditional && statement->conditional->first) {
+		prefetch_script(context, statement->conditional->first->predicate, budget);
+		prefetch_script(context, statement->conditional->first->if_true_block, budget);
+	}
+	if (statement->for_loop)
+		prefetch_script(context, statement->for_loop->script, budget);
+	if (statement->while_loop) {
+		prefetch_script(context, statement->while_loop->predicate, budget);
+		prefetch_script(context, statement->while_loop->script, budget);
+	}
+
+	if (statement->program)
+		pending[npending++] = statement->program;
+	while (npending > 0 && *budget > 0) {
+		const struct program *program = pending[--npending];
+		if (program->words) {
+			prefetch_program(context, program);
+			(*budget)--;
+			if (now_ms() >= context->lookahead_deadline)
+				*budget = 0;
+		} else if (program->script) {
+			prefetch_script(context, program->script, budget);
+		} else if (npending + 2 <= LOOKAHEAD_PROGRAMS) {
+			if (program->rhs)
+				pending[npending++] = program->rhs;
+			if (program->lhs)
+				pending[npending++] = program->lhs;
+		}
+	}
+}
+
+// Called by the parent once a child is running: prepare the statements that
+// follow the current one (context->lookahead, set by the executor).
+void lookahead_prefetch(struct context *context) {
+	const struct statement *statement = context->lookahead;
+	int budget = LOOKAHEAD_PROGRAMS;
+
+	// Only once per statement, even if it forks several children.
+	context->lookahead = NULL;
+	if (statement == NULL)
+		return;
+	const char *enabled = context_get_var(context, "LSH_LOOKAHEAD");
+	if (enabled && strcmp(enabled, "0") == 0)
+		return;
+
+	context->lookahead_deadline = now_ms() + LOOKAHEAD_MAX_MS;
+	for (int i = 0; statement != NULL && i < LOOKAHEAD_STATEMENTS; i++, statement = statement->next)
+		prefetch_statement(context, statement, &budget);
+}
@@ -0,0 +1,343 @@
+// The 'memo' builtin: a content-addressed cache of command results.
+//
+//   memo [--dep FILE]... [--env NAME]... [--clear] [--] command args...
+//
+// The key is the expanded argv, the working directory, the values of the
+// --env variables and the size and mtime of each --dep file. On a hit, the
+// cached stdout and return code are replayed; on a miss, the command runs
+// through run_one_program with its stdout captured into a new entry, which is
+// then replayed the same way. Entries live in $LSH_MEMO_DIR (by default
+// $XDG_CACHE_HOME/lsh/memo or ~/.cache/lsh/memo), and the least recently used
+// ones are evicted once the store exceeds $LSH_MEMO_MAX bytes (default 256M).
+//
+// Each entry is a file named by the 64-bit FNV-1a hash of its key, holding a
+// fixed-size header, the full key (compared on lookup, so hash collisions are
+// misses rather than wrong answers) and the output.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/limits.h>
+
+#include "lsh_ast.h"
+
+#define MEMO_MAGIC		"LSHMEMO1"
+// "LSHMEMO1 <rc> <key length>\n", padded to a fixed size so it can be rewritten in place.
+#define MEMO_HEADER_SIZE	40
+#define DEFAULT_MEMO_MAX	(256L << 20)
+#define MEMO_USAGE		"usage: memo [--dep FILE]... [--env NAME]... [--clear] [--] command args...\n"
+
+struct memo_key {
+	char *buf;
+	size_t len;
+	size_t capacity;
+};
+
+static void memo_key_put(struct memo_key *key, const void *data, size_t n) {
+	if (key->len + n > key->capacity) {
+		while (key->len + n > key->capacity)
+			key->capacity = key->capacity ? key->capacity << 1 : 256;
+		key->buf = realloc(key->buf, key->capacity);
+		CHECK(key->buf != NULL);
+	}
+	memcpy(key->buf + key->len, data, n);
+	key->len += n;
+}
+
+// Strings are stored with their null terminator, which keeps fields unambiguous.
+static void memo_key_puts(struct memo_key *key, const char *s) {
+	memo_key_put(key, s, strlen(s) + 1);
+}
+
+static uint64_t fnv1a64(const char *data, size_t n) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Parse a size such as "1048576", "512K", "64M" or "2G".
+static long parse_size(const char *s) {
+	char *end;
+	long size = strtol(s, &end, 10);
+	if (end == s || size < 0)
+		return -1;
+	switch (*end) {
+		case 'K': case 'k': size <<= 10; end++; break;
+		case 'M': case 'm': size <<= 20; end++; break;
+		case 'G': case 'g': size <<= 30; end++; break;
+	}
+	return *end == 0 ? size : -1;
+}
+
+static int mkdir_p(char *path) {
+	for (char *p = path + 1; ; p++) {
+		if (*p != '/' && *p != 0)
+			continue;
+		char c = *p;
+		*p = 0;
+		int rc = mkdir(path, 0700);
+		*p = c;
+		if (rc != 0 && errno != EEXIST)
+			return -1;
+		if (c == 0)
+			return 0;
+	}
+}
+
+// The store directory, created if needed. Returns 0 on success.
+static int memo_dir(const struct context *context, char *dir, size_t size) {
+	const char *configured = context_get_var(context, "LSH_MEMO_DIR");
+	const char *cache = context_get_var(context, "XDG_CACHE_HOME");
+	const char *home = context_get_var(context, "HOME");
+
+	if (configured && *configured)
+		snprintf(dir, size, "%s", configured);
+	else if (cache && *cache)
+		snprintf(dir, size, "%s/lsh/memo", cache);
+	else if (home && *home)
+		snprintf(dir, size, "%s/.cache/lsh/memo", home);
+	else
+		return -1;
+	return mkdir_p(dir);
+}
+
+// Copy 'count' bytes from 'in_fd' at 'offset' to 'out_fd'.
+static int copy_out(int out_fd, int in_fd, off_t offset, size_t count) {
+	while (count > 0) {
+		ssize_t n = sendfile(out_fd, in_fd, &offset, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			// Fall back to read/write for descriptors sendfile can't handle.
+			char buf[65536];
+			n = pread(in_fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+			if (n > 0 && write(out_fd, buf, n) != n)
+				return -1;
+			offset += n > 0 ? n : 0;
+		}
+		if (n <= 0)
+			return n == 0 ? 0 : -1;
+		count -= n;
+	}
+	return 0;
+}
+
+// If the entry open on 'fd' was stored under 'key', set its return code and
+// the offset of its output and return 1. Otherwise return 0.
+static int memo_entry_matches(int fd, const struct memo_key *key, int *rc, off_t *output_offset) {
+	char header[MEMO_HEADER_SIZE + 1];
+	size_t key_len;
+	int match = 0;
+
+	if (pread(fd, header, MEMO_HEADER_SIZE, 0) != MEMO_HEADER_SIZE)
+		return 0;
+	header[MEMO_HEADER_SIZE] = 0;
+	if (sscanf(header, MEMO_MAGIC " %d %zu", rc, &key_len) != 2 || key_len != key->len)
+		return 0;
+
+	char *stored = malloc(key_len + 1);
+	if (pread(fd, stored, key_len, MEMO_HEADER_SIZE) == (ssize_t)key_len)
+		match = memcmp(stored, key->buf, key_len) == 0;
+	free(stored);
+	*output_offset = MEMO_HEADER_SIZE + (off_t)key_len;
+	return match;
+}
+
+static int memo_write_header(int fd, int rc, size_t key_len) {
+	char header[MEMO_HEADER_SIZE + 1];
+	int n = snprintf(header, sizeof(header), MEMO_MAGIC " %d %zu", rc, key_len);
+	memset(header + n, ' ', MEMO_HEADER_SIZE - 1 - n);
+	header[MEMO_HEADER_SIZE - 1] = '\n';
+	return pwrite(fd, header, MEMO_HEADER_SIZE, 0) == MEMO_HEADER_SIZE ? 0 : -1;
+}
+
+struct memo_entry {
+	char name[NAME_MAX + 1];
+	struct timespec used;
+	off_t size;
+};
+
+static int memo_entry_compare(const void *_a, const void *_b) {
+	const struct memo_entry *a = _a;
+	const struct memo_entry *b = _b;
+	if (a->used.tv_sec != b->used.tv_sec)
+		return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+	if (a->used.tv_nsec != b->used.tv_nsec)
+		return a->used.tv_nsec < b->used.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+// Remove the least recently used entries (by mtime, which a hit refreshes)
+// until the store is within 'max_size' bytes. A 'max_size' of 0 removes all.
+static void memo_evict(const char *dir, long max_size) {
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return;
+
+	int n = 0;
+	int capacity = 64;
+	off_t total = 0;
+	struct memo_entry *entries = malloc(sizeof(*entries) * capacity);
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		struct stat st;
+		// Skip '.', '..' and in-progress temporaries.
+		if (de->d_name[0] == '.' || fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == capacity) {
+			capacity <<= 1;
+			entries = realloc(entries, sizeof(*entries) * capacity);
+		}
+		snprintf(entries[n].name, sizeof(entries[n].name), "%s", de->d_name);
+		entries[n].used = st.st_mtim;
+		entries[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+
+	if (total > max_size) {
+		qsort(entries, n, sizeof(*entries), memo_entry_compare);
+		for (int i = 0; i < n && total > max_size; i++) {
+			if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+				total -= entries[i].size;
+		}
+	}
+	closedir(d);
+	free(entries);
+}
+
+int handle_memo(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	struct memo_key key = { 0 };
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 32];
+	char tmp_path[PATH_MAX + 32];
+	int rc = 0;
+	int i;
+
+	if (memo_dir(context, dir, sizeof(dir)) != 0) {
+		fprintf(stderr, "[lsh_memo.c -> handle_memo()] cannot create the memo store: %d\n", errno);
+		dir[0] = 0;
+	}
+
+	// The key starts with the options, so that '--dep a cmd' and 'cmd' differ.
+	for (i = 1; i < argc; i++) {
+		int takes_value = strcmp(argv[i], "--dep") == 0 || strcmp(argv[i], "--env") == 0;
+		if (takes_value && i + 1 >= argc) {
+			fprintf(stderr, MEMO_USAGE);
+			rc = EINVAL;
+			goto out;
+		}
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		} else if (strcmp(argv[i], "--clear") == 0) {
+			if (dir[0])
+				memo_evict(dir, 0);
+		} else if (strcmp(argv[i], "--dep") == 0) {
+			// Dependencies are identified by size and modification time, not content.
+			struct stat st;
+			char buf[64];
+			memo_key_puts(&key, "dep");
+			memo_key_puts(&key, argv[++i]);
+			if (stat(argv[i], &st) == 0)
+				snprintf(buf, sizeof(buf), "%jd %jd.%09ld", (intmax_t)st.st_size, (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+			else
+				snprintf(buf, sizeof(buf), "missing");
+			memo_key_puts(&key, buf);
+		} else if (strcmp(argv[i], "--env") == 0) {
+			const char *value = context_get_var(context, argv[++i]);
+			memo_key_puts(&key, "env");
+			memo_key_puts(&key, argv[i]);
+			memo_key_puts(&key, value ? value : "");
+			memo_key_put(&key, value ? "=" : "-", 1);
+		} else {
+			break;
+		}
+	}
+	if (i >= argc) {
+		if (strcmp(argv[argc - 1], "--clear") != 0) {
+			fprintf(stderr, MEMO_USAGE);
+			rc = EINVAL;
+		}
+		goto out;
+	}
+
+	// Builtins act on the shell itself; there is nothing to replay.
+	if (dir[0] == 0 || is_builtin(argv[i])) {
+		rc = run_argv(context, run_context, &argv[i], argc - i);
+		goto out;
+	}
+
+	char cwd[PATH_MAX];
+	memo_key_puts(&key, "cwd");
+	memo_key_puts(&key, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+	memo_key_puts(&key, "argv");
+	for (int j = i; j < argc; j++)
+		memo_key_puts(&key, argv[j]);
+
+	uint64_t hash = fnv1a64(key.buf, key.len);
+	snprintf(path, sizeof(path), "%s/%016" PRIx64, dir, hash);
+
+	int out_fd = run_context->stdout_fd >= 0 ? run_context->stdout_fd : STDOUT_FILENO;
+	off_t output_offset;
+	struct stat st;
+	fflush(stdout);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && memo_entry_matches(fd, &key, &rc, &output_offset) && fstat(fd, &st) == 0) {
+		// Hit: refresh its place in the LRU order and replay it.
+		futimens(fd, NULL);
+		copy_out(out_fd, fd, output_offset, st.st_size - output_offset);
+		close(fd);
+		goto out;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	// Miss: capture the command's stdout into a temporary entry, which becomes
+	// the entry once the command has finished.
+	snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp.%d.%016" PRIx64, dir, (int)getpid(), hash);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || memo_write_header(fd, 0, key.len) != 0 || pwrite(fd, key.buf, key.len, MEMO_HEADER_SIZE) != (ssize_t)key.len) {
+		fprintf(stderr, "[lsh_memo.c -> handle_memo()] cannot write %s: %d\n", tmp_path, errno);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		rc = run_argv(context, run_context, &argv[i], argc - i);
+		goto out;
+	}
+	lseek(fd, MEMO_HEADER_SIZE + (off_t)key.len, SEEK_SET);
+
+	struct run_context capture = *run_context;
+	capture.stdout_fd = fd;
+	rc = run_argv(context, &capture, &argv[i], argc - i);
+
+	if (fstat(fd, &st) == 0)
+		copy_out(out_fd, fd, MEMO_HEADER_SIZE + (off_t)key.len, st.st_size - MEMO_HEADER_SIZE - (off_t)key.len);
+
+	// Don't remember timeouts, signals or commands that couldn't be run.
+	if (rc < 124 && memo_write_header(fd, rc, key.len) == 0 && rename(tmp_path, path) == 0) {
+		const char *max = context_get_var(context, "LSH_MEMO_MAX");
+		long max_size = max && *max ? parse_size(max) : DEFAULT_MEMO_MAX;
+		memo_evict(dir, max_size >= 0 ? max_size : DEFAULT_MEMO_MAX);
+	} else {
+		unlink(tmp_path);
+	}
+	close(fd);
+
+out:
+	free(key.buf);
+	return rc;
+}
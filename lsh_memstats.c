@@ -0,0 +1,60 @@
+// The 'memstats' builtin: what the shell has allocated and not yet freed.
+//
+//   memstats
+//
+// prints one 'category count' line per kind of allocation the shell tracks
+// (see enum memstat), then the heap bytes malloc has handed out and the
+// process's resident set size. In a long interactive session, or a loop that
+// runs for days, the counts should return to where they were between commands
+// and the heap and RSS should level off; test_soak.sh checks that they do.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "lsh_ast.h"
+
+long memstats[MEMSTAT_COUNT];
+
+static const char *const memstat_names[MEMSTAT_COUNT] = {
+	[MEMSTAT_AST] = "ast",
+	[MEMSTAT_ENV] = "env",
+	[MEMSTAT_ARGV] = "argv",
+	[MEMSTAT_SCANNER] = "scanner",
+	[MEMSTAT_CONTEXT] = "context",
+};
+
+// The resident set size in bytes, or -1 if /proc isn't there.
+static long resident_bytes(void) {
+	long pages = -1;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+// memstats
+int handle_memstats(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	if (argc > 1) {
+		fprintf(stderr, "usage: memstats\n");
+		return EINVAL;
+	}
+
+	for (int i = 0; i < MEMSTAT_COUNT; i++)
+		printf("%s %ld\n", memstat_names[i], __atomic_load_n(&memstats[i], __ATOMIC_RELAXED));
+	// mallinfo2() returns its struct by value, and there is no other interface to it.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+	struct mallinfo2 info = mallinfo2();
+#pragma GCC diagnostic pop
+	printf("heap %zu\n", info.uordblks + info.hblkhd);
+	printf("rss %ld\n", resident_bytes());
+	fflush(stdout);
+	return 0;
+}
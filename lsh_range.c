@@ -0,0 +1,150 @@
+// Numeric ranges: '{A..B}' and '{A..B..STEP}' words.
+//
+// A range counts from A to B, down if B is less than A, in steps of STEP
+// (default 1; its sign is ignored). If A or B is written with a leading zero,
+// every value is zero padded to the wider of the two, so '{01..10}' gives
+// '01 02 ... 10'.
+//
+// In a command, a range expands to all of its values, as any other word does.
+// A for loop instead takes the values one at a time (struct for_values): the
+// loop's other words are expanded before it starts, as before, but each range
+// generates its next value into a small buffer when the loop asks for it, so
+// 'for i in {1..10000000}' starts at once and uses no more memory than
+// 'for i in {1..10}'.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lsh_ast.h"
+
+// The width to pad a range end to: its length if it has a leading zero.
+static int padded_width(const char *s, const char *end) {
+	const char *digits = *s == '-' ? s + 1 : s;
+	return digits[0] == '0' && end - digits > 1 ? (int)(end - s) : 0;
+}
+
+// Start the range 'text', as the lexer matched it: 'A..B' or 'A..B..STEP'.
+void range_begin(struct range *range, const char *text) {
+	char *end;
+
+	range->next = strtoll(text, &end, 10);
+	int width = padded_width(text, end);
+	const char *s = end + 2;
+	int64_t last = strtoll(s, &end, 10);
+	int last_width = padded_width(s, end);
+	int64_t step = *end == '.' ? strtoll(end + 2, NULL, 10) : 1;
+
+	range->last = last;
+	range->descending = last < range->next;
+	range->step = step < 0 ? 0 - (uint64_t)step : (uint64_t)step;
+	if (range->step == 0)
+		range->step = 1;
+	range->width = width > last_width ? width : last_width;
+	range->done = 0;
+}
+
+// The range's next value, or NULL once it is done. The value is overwritten by
+// the next call.
+const char *range_next(struct range *range) {
+	if (range->done)
+		return NULL;
+	snprintf(range->buf, sizeof(range->buf), "%0*" PRId64, range->width, range->next);
+
+	// The distance left, exactly, whichever way the range runs.
+	uint64_t left = range->descending ? (uint64_t)range->next - (uint64_t)range->last : (uint64_t)range->last - (uint64_t)range->next;
+	if (left < range->step)
+		range->done = 1;
+	else if (range->descending)
+		range->next = (int64_t)((uint64_t)range->next - range->step);
+	else
+		range->next = (int64_t)((uint64_t)range->next + range->step);
+	return range->buf;
+}
+
+// A run of a for loop's words: either the expanded values of consecutive
+// ordinary words, or one range.
+struct for_segment {
+	struct argv_buf *argv;
+	const struct word *range;
+};
+
+struct for_values {
+	struct for_segment *segments;
+	int nsegments;
+	int segment;
+	// The position in the current segment.
+	int index;
+	struct range range;
+};
+
+static void add_segment(struct for_values *values, struct argv_buf *argv, const struct word *range) {
+	values->segments = realloc(values->segments, sizeof(*values->segments) * (values->nsegments + 1));
+	CHECK(values->segments != NULL);
+	values->segments[values->nsegments].argv = argv;
+	values->segments[values->nsegments].range = range;
+	values->nsegments++;
+}
+
+// Expand the words of a for loop, except for its ranges, ready to iterate.
+// Returns NULL if an expansion fails.
+struct for_values *for_values_begin(const struct context *context, const struct words *words) {
+	struct for_values *values = calloc(1, sizeof(*values));
+	CHECK(values != NULL);
+
+	const struct word *first = NULL;
+	for (const struct word *word = words ? words->first : NULL; ; word = word->next) {
+		if (word == NULL || word->is_range) {
+			// Expand the ordinary words since the last range.
+			if (first) {
+				struct words run = { (struct word *)first, NULL };
+				for (run.last = run.first; run.last->next != word; run.last = run.last->next)
+					;
+				struct argv_buf *argv = make_argv(context, &run);
+				add_segment(values, argv, NULL);
+				if (argv->error) {
+					for_values_end(values);
+					return NULL;
+				}
+				first = NULL;
+			}
+			if (word == NULL)
+				break;
+			add_segment(values, NULL, word);
+		} else if (first == NULL) {
+			first = word;
+		}
+	}
+	return values;
+}
+
+// The loop's next value, or NULL when there are no more.
+const char *for_values_next(struct for_values *values) {
+	while (values && values->segment < values->nsegments) {
+		struct for_segment *segment = &values->segments[values->segment];
+		if (segment->range) {
+			if (values->index++ == 0)
+				range_begin(&values->range, segment->range->text);
+			const char *value = range_next(&values->range);
+			if (value)
+				return value;
+		} else if (values->index < segment->argv->argc) {
+			return segment->argv->argv[values->index++];
+		}
+		values->segment++;
+		values->index = 0;
+	}
+	return NULL;
+}
+
+void for_values_end(struct for_values *values) {
+	if (values == NULL)
+		return;
+	for (int i = 0; i < values->nsegments; i++) {
+		if (values->segments[i].argv)
+			free_argv(values->segments[i].argv);
+	}
+	free(values->segments);
+	free(values);
+}
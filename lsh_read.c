@@ -0,0 +1,203 @@
+// The 'read' builtin, and the buffered reader behind it.
+//
+//   read [-r] [NAME]...
+//
+// 'read' takes one line of input and assigns its whitespace separated fields to
+// the NAMEs, the last one getting the rest of the line (REPLY if there are no
+// NAMEs). It returns 0, or 1 at the end of the input.
+//
+// A shell reading a pipe a byte at a time, so as not to consume input meant for
+// the next command, makes a system call per character. Instead, a 'while' loop
+// attaches a line_reader to its stdin for as long as it runs
+// (run_context->reader): the reader fills a READ_BLOCK sized buffer at a time
+// and 'read' takes lines out of it, so memory stays at one block plus the
+// longest line however long the input is. The catch is that other commands in
+// the loop reading the same stdin don't see what the reader has buffered. When
+// the loop ends, seekable input is rewound to just past the last line taken, so
+// the commands after the loop carry on from there.
+//
+// Outside a loop, 'read' still reads seekable input a block at a time and
+// rewinds, but reads anything else a byte at a time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "lsh_ast.h"
+
+#define READ_BLOCK	(64 * 1024)
+
+struct line_reader {
+	int fd;
+	size_t block;
+	char *buf;
+	// buf[start, end) is read but not yet taken.
+	size_t start;
+	size_t end;
+	size_t capacity;
+	int eof;
+	// The reader this one replaced in the run context, restored on detach.
+	struct line_reader *outer;
+};
+
+static int input_fd(const struct run_context *run_context) {
+	return run_context->stdin_fd >= 0 ? run_context->stdin_fd : STDIN_FILENO;
+}
+
+static int is_seekable(int fd) {
+	return lseek(fd, 0, SEEK_CUR) != -1;
+}
+
+static struct line_reader *line_reader_open(int fd, size_t block) {
+	struct line_reader *reader = calloc(1, sizeof(*reader));
+	CHECK(reader != NULL);
+	reader->fd = fd;
+	reader->block = block;
+	return reader;
+}
+
+// Give back what was read past the last line taken, if the input can seek.
+static void line_reader_close(struct line_reader *reader) {
+	if (reader->end > reader->start)
+		lseek(reader->fd, -(off_t)(reader->end - reader->start), SEEK_CUR);
+	free(reader->buf);
+	free(reader);
+}
+
+// Take the next line, without its newline, NUL terminated in the buffer.
+// Returns 1 for a line, 0 at the end of the input (with '*len' > 0 if it ended
+// in the middle of a line) and -1 on a read error.
+static int line_reader_getline(struct line_reader *reader, char **line, size_t *len) {
+	size_t scanned = reader->start;
+
+	for (;;) {
+		char *nl = reader->end > scanned ? memchr(reader->buf + scanned, '\n', reader->end - scanned) : NULL;
+		if (nl) {
+			*nl = 0;
+			*line = reader->buf + reader->start;
+			*len = nl - *line;
+			reader->start = nl + 1 - reader->buf;
+			return 1;
+		}
+		if (reader->eof) {
+			// One byte is always spare for the terminator.
+			reader->buf[reader->end] = 0;
+			*line = reader->buf + reader->start;
+			*len = reader->end - reader->start;
+			reader->start = reader->end;
+			return 0;
+		}
+
+		// Move the partial line to the front, and make room for a block after it.
+		scanned = reader->end;
+		if (reader->start > 0) {
+			memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+			scanned -= reader->start;
+			reader->end -= reader->start;
+			reader->start = 0;
+		}
+		if (reader->capacity < reader->end + reader->block + 1) {
+			while (reader->capacity < reader->end + reader->block + 1)
+				reader->capacity = reader->capacity ? reader->capacity << 1 : reader->block + 1;
+			reader->buf = realloc(reader->buf, reader->capacity);
+			CHECK(reader->buf != NULL);
+		}
+
+		ssize_t n = read(reader->fd, reader->buf + reader->end, reader->block);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "[lsh_read.c -> line_reader_getline()] read error: %d\n", errno);
+			reader->buf[reader->start] = 0;
+			*line = reader->buf + reader->start;
+			*len = 0;
+			return -1;
+		}
+		if (n == 0)
+			reader->eof = 1;
+		reader->end += n;
+	}
+}
+
+// Attach a block buffered reader to the run context's stdin, for a 'while'
+// loop. Returns the reader to pass to line_reader_detach once the loop is done,
+// or NULL if an enclosing loop's reader already reads the same input.
+struct line_reader *line_reader_attach(struct run_context *run_context) {
+	int fd = input_fd(run_context);
+	if (run_context->reader && run_context->reader->fd == fd)
+		return NULL;
+
+	struct line_reader *reader = line_reader_open(fd, READ_BLOCK);
+	reader->outer = run_context->reader;
+	run_context->reader = reader;
+	return reader;
+}
+
+void line_reader_detach(struct run_context *run_context, struct line_reader *reader) {
+	if (reader == NULL)
+		return;
+	run_context->reader = reader->outer;
+	line_reader_close(reader);
+}
+
+static int is_ifs(char c) {
+	return c == ' ' || c == '\t';
+}
+
+// read [-r] [NAME]...
+// There are no backslash escapes to process, so -r is accepted and ignored.
+int handle_read(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	int i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(argv[i], "-r") != 0) {
+			fprintf(stderr, "read: unknown option '%s'\n", argv[i]);
+			return 2;
+		}
+	}
+	int nnames = i < argc ? argc - i : 1;
+
+	int fd = input_fd(run_context);
+	struct line_reader *reader = run_context->reader;
+	struct line_reader *own = NULL;
+	if (reader == NULL || reader->fd != fd)
+		reader = own = line_reader_open(fd, is_seekable(fd) ? READ_BLOCK : 1);
+
+	char *line;
+	size_t len;
+	int got = line_reader_getline(reader, &line, &len);
+
+	// Split into fields; the last name gets the rest of the line, less surrounding blanks.
+	char *p = line;
+	while (is_ifs(*p))
+		p++;
+	for (int j = 0; j < nnames; j++) {
+		char *value = p;
+		if (j == nnames - 1) {
+			char *e = value + strlen(value);
+			while (e > value && is_ifs(e[-1]))
+				e--;
+			*e = 0;
+		} else {
+			while (*p && !is_ifs(*p))
+				p++;
+			if (*p) {
+				*p++ = 0;
+				while (is_ifs(*p))
+					p++;
+			}
+		}
+		context_set_var(context, i < argc ? argv[i + j] : "REPLY", value);
+	}
+
+	if (own)
+		line_reader_close(own);
+	return got == 1 ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+// Builtins as pipeline stages. A builtin that only writes output, such as
+// 'echo $LIST' in 'echo $LIST | grep x', doesn't need a process of its own: it
+// runs on a thread in the shell, writing to its pipe, while the external stages
+// are forked as usual.
+//
+// Output of VMSPLICE_MIN bytes or more is built in freshly mapped pages and
+// handed to the pipe with vmsplice, so the pipe references the pages rather
+// than copying them. The pages are unmapped, never modified, afterwards.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "lsh_ast.h"
+
+#define VMSPLICE_MIN	(64 * 1024)
+
+struct thread_stage {
+	struct context *context;
+	struct argv_buf *argv;
+	int out_fd;
+};
+
+struct output_buf {
+	char *data;
+	size_t len;
+	int mapped;
+};
+
+// Builtins that neither read the shell's state nor change it, and so can run
+// on a thread concurrently with the rest of the pipeline.
+int is_thread_builtin(const char *argv0) {
+	return strcmp(argv0, "echo") == 0;
+}
+
+static int output_buf_alloc(struct output_buf *out, size_t len) {
+	out->data = NULL;
+	out->len = len;
+	out->mapped = len >= VMSPLICE_MIN;
+	if (out->mapped) {
+		out->data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (out->data == MAP_FAILED) {
+			out->mapped = 0;
+			out->data = NULL;
+		}
+	}
+	if (out->data == NULL)
+		out->data = malloc(len + 1);
+	return out->data == NULL ? -1 : 0;
+}
+
+static void output_buf_free(struct output_buf *out) {
+	if (out->mapped)
+		munmap(out->data, out->len);
+	else
+		free(out->data);
+}
+
+// Write the buffer to 'fd' and release it. Returns 0 on success.
+static int output_buf_flush(struct output_buf *out, int fd) {
+	size_t done = 0;
+
+	while (out->mapped && done < out->len) {
+		struct iovec iov = { .iov_base = out->data + done, .iov_len = out->len - done };
+		ssize_t n = vmsplice(fd, &iov, 1, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;	// Not a pipe (EBADF, EINVAL): fall back to write.
+		done += n;
+	}
+	while (done < out->len) {
+		ssize_t n = write(fd, out->data + done, out->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		done += n;
+	}
+
+	output_buf_free(out);
+	return done == out->len ? 0 : -1;
+}
+
+// echo [-n] args...
+int handle_echo(struct context *context, struct run_context *run_context, char **argv, int argc) {
+	struct output_buf out;
+	int newline = 1;
+	int i = 1;
+	size_t len = 0;
+
+	if (i < argc && strcmp(argv[i], "-n") == 0) {
+		newline = 0;
+		i++;
+	}
+	for (int j = i; j < argc; j++)
+		len += strlen(argv[j]) + (j > i);
+	len += newline;
+
+	int fd = run_context->stdout_fd >= 0 ? run_context->stdout_fd : STDOUT_FILENO;
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+	if (len == 0)
+		return 0;
+	if (output_buf_alloc(&out, len) != 0)
+		return ENOMEM;
+
+	char *p = out.data;
+	for (int j = i; j < argc; j++) {
+		if (j > i)
+			*p++ = ' ';
+		size_t n = strlen(argv[j]);
+		memcpy(p, argv[j], n);
+		p += n;
+	}
+	if (newline)
+		*p = '\n';
+
+	return output_buf_flush(&out, fd) == 0 ? 0 : 1;
+}
+
+static void *thread_stage_main(void *arg) {
+	struct thread_stage *stage = arg;
+	struct run_context run_context = DEFAULT_RUN_CONTEXT;
+	sigset_t sigpipe;
+
+	// A reader that went away must fail this stage's writes with EPIPE, not
+	// kill the whole shell.
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+	run_context.stdout_fd = stage->out_fd;
+	handle_builtin(stage->context, &run_context, stage->argv->argv, stage->argv->argc);
+
+	close(stage->out_fd);
+	free_argv(stage->argv);
+	free(stage);
+	return NULL;
+}
+
+// Run the builtin in 'argv' on a new thread writing to 'out_fd'. The thread
+// takes ownership of both, closing 'out_fd' when it is done. Returns 0 on
+// success; on failure the caller still owns them.
+int start_thread_stage(struct context *context, struct argv_buf *argv, int out_fd, pthread_t *thread) {
+	struct thread_stage *stage = malloc(sizeof(*stage));
+	stage->context = context;
+	stage->argv = argv;
+	stage->out_fd = out_fd;
+
+	int err = pthread_create(thread, NULL, thread_stage_main, stage);
+	if (err != 0) {
+		fprintf(stderr, "[lsh_threads.c -> start_thread_stage()] pthread_create error: %d\n", err);
+		free(stage);
+		return -1;
+	}
+	return 0;
+}
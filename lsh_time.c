@@ -0,0 +1,185 @@
+// The 'time' keyword: reports real, user and sys time for any foreground
+// statement, including pipelines, loops and conditionals. User and sys time are
+// the shell's own usage plus that of every child reaped while the statement ran.
+//
+// The report is formatted by TIMEFORMAT, as in bash: %R, %U and %S are real,
+// user and sys seconds, with an optional precision digit and an 'l' for the
+// MmS.FFFs form (e.g. %3lR), %P is the cpu percentage and %% a literal '%'. The
+// escapes \n and \t are expanded. An empty TIMEFORMAT disables the report.
+//
+// If LSH_TIME_LOG names a file, a JSON record per timed statement is also
+// appended to it, for aggregation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lsh_ast.h"
+
+#define DEFAULT_TIMEFORMAT	"\\nreal\\t%3lR\\nuser\\t%3lU\\nsys\\t%3lS"
+
+void time_sample_begin(struct time_sample *sample) {
+	clock_gettime(CLOCK_MONOTONIC, &sample->real);
+	getrusage(RUSAGE_SELF, &sample->self);
+	getrusage(RUSAGE_CHILDREN, &sample->children);
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b) {
+	return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static double timeval_diff(const struct timeval *a, const struct timeval *b) {
+	return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_usec - a->tv_usec) / 1e6;
+}
+
+// Like bash, the digits past 'precision' are dropped rather than rounded, so that
+// 59.9996 seconds is 0m59.999s and not 0m60.000s.
+static void format_seconds(FILE *f, double seconds, int precision, int long_form) {
+	static const long divisors[] = { 1000, 100, 10, 1 };
+	long ms = seconds > 0 ? (long)(seconds * 1000) : 0;
+	long whole = ms / 1000;
+
+	if (long_form) {
+		fprintf(f, "%ldm", whole / 60);
+		whole %= 60;
+	}
+	fprintf(f, "%ld", whole);
+	if (precision > 0)
+		fprintf(f, ".%0*ld", precision, ms % 1000 / divisors[precision]);
+	if (long_form)
+		fputc('s', f);
+}
+
+static void print_timeformat(FILE *f, const char *format, double real, double user, double sys) {
+	for (const char *p = format; *p; p++) {
+		if (*p == '\\' && (p[1] == 'n' || p[1] == 't')) {
+			fputc(p[1] == 'n' ? '\n' : '\t', f);
+			p++;
+			continue;
+		}
+		if (*p != '%') {
+			fputc(*p, f);
+			continue;
+		}
+		p++;
+		int precision = 3;
+		int long_form = 0;
+		if (*p >= '0' && *p <= '9') {
+			precision = *p - '0';
+			if (precision > 3)
+				precision = 3;
+			p++;
+		}
+		if (*p == 'l') {
+			long_form = 1;
+			p++;
+		}
+		switch (*p) {
+			case 'R':
+				format_seconds(f, real, precision, long_form);
+				break;
+			case 'U':
+				format_seconds(f, user, precision, long_form);
+				break;
+			case 'S':
+				format_seconds(f, sys, precision, long_form);
+				break;
+			case 'P':
+				fprintf(f, "%.2f", real > 0 ? (user + sys) * 100 / real : 0.0);
+				break;
+			case '%':
+				fputc('%', f);
+				break;
+			case 0:
+				p--;
+				break;
+			default:
+				fputc('%', f);
+				fputc(*p, f);
+				break;
+		}
+	}
+	fputc('\n', f);
+}
+
+// A short description of the statement for the log: the unexpanded words of
+// its first simple command, or the kind of construct.
+static const struct words *statement_first_words(const struct statement *statement) {
+	const struct program *program = statement->program;
+	while (program != NULL) {
+		if (program->words)
+			return program->words;
+		if (program->script && program->script->first)
+			return statement_first_words(program->script->first);
+		program = program->lhs;
+	}
+	return NULL;
+}
+
+static void json_puts(FILE *f, const char *s) {
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+}
+
+static void append_time_log(const char *path, const struct statement *statement, double real, double user, double sys, int rc) {
+	char *record = NULL;
+	size_t record_len = 0;
+	FILE *f = open_memstream(&record, &record_len);
+	if (f == NULL)
+		return;
+
+	const struct words *words = statement_first_words(statement);
+	fprintf(f, "{\"pid\": %d, \"cmd\": \"", (int)getpid());
+	if (words) {
+		int i = 0;
+		for (const struct word *w = words->first; w != NULL; w = w->next) {
+			fprintf(f, "%s%s", i++ ? " " : "", w->is_var ? "$" : w->is_arith ? "$((" : w->is_range ? "{" : "");
+			json_puts(f, w->text);
+			fprintf(f, "%s", w->is_arith ? "))" : w->is_range ? "}" : "");
+		}
+	} else {
+		fprintf(f, "%s", statement->for_loop ? "for" : statement->while_loop ? "while" : statement->conditional ? "if" : "");
+	}
+	fprintf(f, "\", \"rc\": %d, \"real\": %.6f, \"user\": %.6f, \"sys\": %.6f}\n", rc, real, user, sys);
+	fclose(f);
+
+	// One write() with O_APPEND, so records from concurrent jobs don't interleave.
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, record, record_len) != (ssize_t)record_len)
+		fprintf(stderr, "[lsh_time.c -> append_time_log()] writing %s error: %d\n", path, errno);
+	if (fd >= 0)
+		close(fd);
+	free(record);
+}
+
+void time_sample_report(const struct context *context, const struct statement *statement, const struct time_sample *start, int rc) {
+	struct time_sample end;
+	time_sample_begin(&end);
+
+	double real = timespec_diff(&start->real, &end.real);
+	double user = timeval_diff(&start->self.ru_utime, &end.self.ru_utime)
+		+ timeval_diff(&start->children.ru_utime, &end.children.ru_utime);
+	double sys = timeval_diff(&start->self.ru_stime, &end.self.ru_stime)
+		+ timeval_diff(&start->children.ru_stime, &end.children.ru_stime);
+
+	const char *format = context_get_var(context, "TIMEFORMAT");
+	if (format == NULL)
+		format = DEFAULT_TIMEFORMAT;
+	if (*format) {
+		fflush(stdout);
+		print_timeformat(stderr, format, real, user, sys);
+	}
+
+	const char *log = context_get_var(context, "LSH_TIME_LOG");
+	if (log && *log)
+		append_time_log(log, statement, real, user, sys, rc);
+}
@@ -0,0 +1,162 @@
+// perfrun: run a command and record what it cost, for test_perf.sh.
+//
+//   perfrun -o FILE command args...
+//
+// Appends one line, 'wall_ms forks maxrss_kb', to FILE:
+// - wall_ms: the command's wall clock time;
+// - forks: the processes (and threads) the command's tree created. The command
+//   runs in a pid namespace of its own, under a small init that waits for it and
+//   then forks a probe: pids in a new namespace are handed out in order from 1,
+//   so the probe's pid, less init, the command and the probe, is the count.
+//   Where a namespace can't be created (no CAP_SYS_ADMIN and no user
+//   namespaces) it falls back to the system-wide 'processes' counter in
+//   /proc/stat, which other activity on the machine adds to;
+// - maxrss_kb: the peak RSS of the largest process in the command's tree that
+//   was waited for (getrusage(RUSAGE_CHILDREN)).
+// The exit status is the command's.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// The number of forks since boot.
+static long forks_since_boot(void) {
+	char line[256];
+	long n = -1;
+	FILE *f = fopen("/proc/stat", "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "processes %ld", &n) == 1)
+			break;
+	}
+	fclose(f);
+	return n;
+}
+
+static void exec_command(char **argv) {
+	execvp(argv[0], argv);
+	fprintf(stderr, "[perfrun.c -> exec_command()] execvp '%s' error: %d\n", argv[0], errno);
+	_exit(127);
+}
+
+static int wait_for(pid_t pid, int *wstatus) {
+	while (waitpid(pid, wstatus, 0) == -1) {
+		if (errno != EINTR) {
+			fprintf(stderr, "[perfrun.c -> wait_for()] waitpid error: %d\n", errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int status_to_rc(int wstatus) {
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	return 128 + WTERMSIG(wstatus);
+}
+
+// Pid 1 of the command's namespace: run the command, then write the number of
+// processes its tree created to 'count_fd' and exit with its return code. Any
+// of its processes still running when init exits are killed.
+static void run_init(char **argv, int count_fd) {
+	int wstatus;
+	pid_t pid = fork();
+	if (pid == -1)
+		_exit(126);
+	if (pid == 0) {
+		close(count_fd);
+		exec_command(argv);
+	}
+	// Orphans are reparented here; reap them until the command itself exits.
+	for (;;) {
+		pid_t done = wait(&wstatus);
+		if (done == pid)
+			break;
+		if (done == -1 && errno != EINTR)
+			_exit(126);
+	}
+
+	long forks = -1;
+	pid_t probe = fork();
+	if (probe == 0)
+		_exit(0);
+	if (probe > 0) {
+		waitpid(probe, NULL, 0);
+		forks = probe - 3;
+	}
+	// perfrun reports -1 if this doesn't arrive.
+	ssize_t written = write(count_fd, &forks, sizeof(forks));
+	(void)written;
+	_exit(status_to_rc(wstatus));
+}
+
+int main(int argc, char **argv) {
+	if (argc < 4 || strcmp(argv[1], "-o") != 0) {
+		fprintf(stderr, "usage: perfrun -o FILE command args...\n");
+		return 2;
+	}
+	FILE *out = fopen(argv[2], "a");
+	if (out == NULL) {
+		fprintf(stderr, "[perfrun.c -> main()] fopen '%s' error: %d\n", argv[2], errno);
+		return 2;
+	}
+
+	struct timespec start, end;
+	int in_namespace = unshare(CLONE_NEWPID) == 0 || unshare(CLONE_NEWUSER | CLONE_NEWPID) == 0;
+	int count_pipe[2] = { -1, -1 };
+	if (in_namespace && pipe(count_pipe) != 0) {
+		fprintf(stderr, "[perfrun.c -> main()] pipe error: %d\n", errno);
+		return 2;
+	}
+	long forks_before = in_namespace ? 0 : forks_since_boot();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "[perfrun.c -> main()] fork error: %d\n", errno);
+		return 2;
+	}
+	if (pid == 0) {
+		fclose(out);
+		if (in_namespace) {
+			close(count_pipe[0]);
+			run_init(&argv[3], count_pipe[1]);
+		}
+		exec_command(&argv[3]);
+	}
+
+	int wstatus;
+	if (wait_for(pid, &wstatus) != 0)
+		return 2;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	long forks = -1;
+	int rc = status_to_rc(wstatus);
+	if (in_namespace) {
+		// init exits with the command's return code.
+		close(count_pipe[1]);
+		if (read(count_pipe[0], &forks, sizeof(forks)) != sizeof(forks))
+			forks = -1;
+		close(count_pipe[0]);
+	} else {
+		long forks_after = forks_since_boot();
+		if (forks_before >= 0 && forks_after >= 0)
+			forks = forks_after - forks_before - 1;
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_CHILDREN, &usage);
+	double wall_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	fprintf(out, "%.3f %ld %ld\n", wall_ms, forks, usage.ru_maxrss);
+	fclose(out);
+	return rc;
+}
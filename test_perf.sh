@@ -0,0 +1,134 @@
+#!/bin/bash
+# Differential performance test against bash. Runs each test_section?.sh script
+# and some larger generated workloads under ./lsh and bash ($REFERENCE), RUNS times each
+# (after one warm-up run), recording wall time, forks and peak RSS with
+# ./perfrun. For each lsh/bash ratio it reports the geometric means and a 95%
+# confidence interval, and fails if the ratio has regressed against
+# perf_baseline.txt: if the whole interval lies above the baseline ratio times
+# (1 + THRESHOLD), and lsh's mean is more than MIN_DELTA (wall ms, forks and RSS
+# KB) above what that allows. A line of the baseline file can set its own
+# threshold. It also fails if lsh's exit status for a workload differs from bash's.
+# Usage: make test_perf (or RUNS=... THRESHOLD=... N=... bash test_perf.sh)
+#        UPDATE_BASELINE=1 bash test_perf.sh rewrites perf_baseline.txt,
+#        keeping any thresholds set in it.
+
+RUNS=${RUNS:-10}
+THRESHOLD=${THRESHOLD:-0.25}
+MIN_DELTA=${MIN_DELTA:-5 2 1024}
+N=${N:-100000}
+LSH=${LSH:-./lsh}
+REFERENCE=${REFERENCE:-bash}
+PERFRUN=${PERFRUN:-./perfrun}
+BASELINE=${BASELINE:-perf_baseline.txt}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# repeat TEXT COUNT: TEXT repeated COUNT times, on one line.
+repeat() {
+	yes "$1" | head -n "$2" | tr -d '\n'
+}
+
+# Workloads both shells run the same way: name, then script.
+workloads=()
+for script in test_section?.sh; do
+	workloads+=("${script%.sh}" "$script")
+done
+
+echo "for i in {1..$N} ; do x=\$((i % 7)) ; y=\$x ; done" > "$tmp/arith_loop.sh"
+echo "for i in {1..$((N / 100))} ; do /bin/true ; done" > "$tmp/fork_loop.sh"
+echo "seq 1 $((N * 10)) | grep 7 | sort -n | uniq | wc -l" > "$tmp/pipeline.sh"
+echo "seq 1 $N | while read line ; do last=\$line ; done" > "$tmp/while_read.sh"
+{ repeat 'cd . && ' "$((N / 10))"; echo 'cd .'; } > "$tmp/and_chain.sh"
+for name in arith_loop fork_loop pipeline while_read and_chain; do
+	workloads+=("$name" "$tmp/$name.sh")
+done
+
+# Interleave the shells, so that drift in the machine's load affects both alike. A run where the
+# shells' exit statuses differ (lsh crashed, or failed early) is dropped and reported, and fails
+# the test: its numbers would only flatter lsh.
+samples="$tmp/samples"
+touch "$samples"
+mismatched=0
+declare -A status sample
+for ((run = 0; run <= RUNS; run++)); do
+	for ((i = 0; i < ${#workloads[@]}; i += 2)); do
+		for shell in lsh bash; do
+			if [ $shell == lsh ]; then bin=$LSH; else bin=$REFERENCE; fi
+			rm -f "$tmp/one"
+			"$PERFRUN" -o "$tmp/one" "$bin" "${workloads[i + 1]}" > /dev/null 2>&1
+			status[$shell]=$?
+			sample[$shell]="${workloads[i]} $shell $(cat "$tmp/one" 2> /dev/null)"
+		done
+		if [ "${status[lsh]}" != "${status[bash]}" ]; then
+			echo "perf '${workloads[i]}' run $run dropped: lsh exited ${status[lsh]}, bash ${status[bash]}"
+			mismatched=1
+		elif [ $run -gt 0 ]; then
+			# Run 0 warms the page cache, and isn't counted.
+			printf '%s\n%s\n' "${sample[lsh]}" "${sample[bash]}" >> "$samples"
+		fi
+	done
+done
+
+touch "$BASELINE"
+awk -v threshold="$THRESHOLD" -v min_delta="$MIN_DELTA" -v update="${UPDATE_BASELINE:-0}" -v baseline_file="$BASELINE" '
+	# Two-sided 95% t values by degrees of freedom.
+	function t95(df) {
+		if (df <= 1) return 12.71; if (df == 2) return 4.30; if (df == 3) return 3.18
+		if (df == 4) return 2.78; if (df == 5) return 2.57; if (df <= 7) return 2.40
+		if (df <= 10) return 2.25; if (df <= 15) return 2.15; if (df <= 20) return 2.09
+		if (df <= 30) return 2.04; return 1.96
+	}
+	FILENAME == baseline_file {
+		if ($0 !~ /^#/ && NF >= 3) {
+			base[$1 " " $2] = $3
+			limit[$1 " " $2] = NF >= 4 ? $4 : threshold
+			if (NF >= 4) own[$1 " " $2] = $4
+		}
+		next
+	}
+	{
+		if (!($1 in seen)) { seen[$1] = 1; order[nw++] = $1 }
+		for (m = 0; m < 3; m++) {
+			# Forks can be 0; they are compared as forks + 1.
+			v = $(m + 3) + (m == 1)
+			if (v <= 0) v = 1e-9
+			k = $1 " " $2 " " m
+			n[k]++; sum[k] += log(v); sumsq[k] += log(v) * log(v)
+		}
+	}
+	END {
+		split("wall_ms forks maxrss_kb", metric, " ")
+		split(min_delta, floor, " ")
+		printf "%-22s %-10s %12s %12s %7s %17s %8s  %s\n", "workload", "metric", "lsh", "bash", "ratio", "95% CI", "baseline", "status"
+		if (update)
+			print "# workload metric lsh/bash-ratio [threshold]" > baseline_file
+		for (w = 0; w < nw; w++) {
+			for (m = 0; m < 3; m++) {
+				l = order[w] " lsh " m; b = order[w] " bash " m
+				ml = sum[l] / n[l]; mb = sum[b] / n[b]
+				vl = n[l] > 1 ? (sumsq[l] - n[l] * ml * ml) / (n[l] - 1) : 0
+				vb = n[b] > 1 ? (sumsq[b] - n[b] * mb * mb) / (n[b] - 1) : 0
+				if (vl < 0) vl = 0; if (vb < 0) vb = 0
+				d = ml - mb
+				half = t95(n[l] + n[b] - 2) * sqrt(vl / n[l] + vb / n[b])
+				lo = exp(d - half); hi = exp(d + half)
+				key = order[w] " " metric[m + 1]
+				status = "new"; shown = "-"
+				if (key in base) {
+					shown = sprintf("%.3f", base[key])
+					# The interval of a ratio can lie above the limit by a trifling amount, such as one
+					# fork against a bash that forks none, or a millisecond on a short script.
+					allowed = base[key] * (1 + limit[key])
+					excess = exp(ml) - exp(mb) * allowed
+					status = lo > allowed && excess > floor[m + 1] ? "REGRESSED" : "ok"
+					if (status == "REGRESSED") failed = 1
+				}
+				printf "%-22s %-10s %12.1f %12.1f %7.3f   [%5.3f, %5.3f] %8s  %s\n", order[w], metric[m + 1], exp(ml) - (m == 1), exp(mb) - (m == 1), exp(d), lo, hi, shown, status
+				if (update)
+					printf("%s %.3f%s\n", key, exp(d), key in own ? " " own[key] : "") > baseline_file
+			}
+		}
+		exit failed
+	}' "$BASELINE" "$samples" || mismatched=1
+exit $mismatched
@@ -0,0 +1,111 @@
+#!/bin/bash
+# Soak test for memory growth. Runs a million commands through ./lsh from a
+# script, and a stream of lines (some of them syntax errors) at an interactive
+# prompt, and checks with the 'memstats' builtin that what the shell has
+# allocated comes back to where it was after a warm-up, and that its RSS grows
+# by no more than SLACK_KB.
+# Usage: make test_soak (or N=... LINES=... bash test_soak.sh)
+
+N=${N:-1000000}
+LINES=${LINES:-100000}
+SLACK_KB=${SLACK_KB:-1024}
+LSH=${LSH:-./lsh}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# compare NAME OUTPUT: OUTPUT holds two 'memstats' reports, after the warm-up
+# and at the end; every count must match, and RSS grow by at most SLACK_KB.
+compare() {
+	local name=$1 out=$2
+	local verdict
+	verdict=$(echo "$out" | awk -v slack=$((SLACK_KB * 1024)) '
+		/^(ast|env|argv|scanner|context|heap|rss) -?[0-9]+$/ {
+			if ($1 in first) { last[$1] = $2 } else { first[$1] = $2; order[n++] = $1 }
+		}
+		END {
+			if (!("rss" in last)) { print "no memstats output"; exit }
+			for (i = 0; i < n; i++) {
+				k = order[i]
+				if (k == "rss" || k == "heap") {
+					if (last[k] - first[k] > slack) printf "%s grew from %d to %d\n", k, first[k], last[k]
+				} else if (last[k] != first[k]) {
+					printf "%s went from %d to %d\n", k, first[k], last[k]
+				}
+			}
+		}')
+	if [ -z "$verdict" ]; then
+		echo "soak '$name' ok"
+	else
+		echo "soak '$name' FAILED:"
+		echo "$verdict"
+		failed=1
+	fi
+}
+
+# Three commands an iteration: an arithmetic assignment, an assignment from a
+# variable and a builtin with a variable argument.
+loop() {
+	echo "for i in {1..$1} ; do x=\$((i % 7)) ; y=v\$x ; cd \$PWD ; done"
+}
+{ loop $((N / 100)); echo memstats; loop $((N / 3)); echo memstats; } > "$tmp/script.sh"
+compare "$N commands from a script" "$("$LSH" "$tmp/script.sh" 2>&1)"
+
+# The interactive prompt parses each line with the same scanner; every tenth
+# line doesn't parse. Needs python3 for the pseudo-terminal.
+if command -v python3 > /dev/null; then
+	out=$(python3 - "$LSH" "$LINES" << 'EOF'
+import os, pty, re, select, sys, termios
+
+lsh, lines = sys.argv[1], int(sys.argv[2])
+pid, fd = pty.fork()
+if pid == 0:
+	# No kernel echo of lines typed ahead: it would land in the middle of the
+	# shell's output. readline echoes the line it is reading itself.
+	attrs = termios.tcgetattr(0)
+	attrs[3] &= ~termios.ECHO
+	termios.tcsetattr(0, termios.TCSANOW, attrs)
+	os.execv(lsh, [lsh])
+
+def script():
+	for count in (lines // 100, lines):
+		for i in range(count):
+			yield b"( echo oops\n" if i % 10 == 9 else b"x=$((x + 1)) ; y=v$x\n"
+		yield b"memstats\n"
+	yield b"exit\n"
+
+# Non-blocking, so that writing to a full input queue can't keep us from
+# reading the echo the shell is blocked writing.
+os.set_blocking(fd, False)
+out = bytearray()
+pending = b"".join(script())
+while True:
+	r, w, _ = select.select([fd], [fd] if pending else [], [])
+	if fd in r:
+		try:
+			data = os.read(fd, 65536)
+			if not data:
+				break
+			out += data
+		except BlockingIOError:
+			pass
+		except OSError:
+			break
+	if fd in w:
+		try:
+			pending = pending[os.write(fd, pending[:1024]):]
+		except BlockingIOError:
+			pass
+os.waitpid(pid, 0)
+# Without readline's terminal escapes, so each report line starts a line.
+out = re.sub(rb"\x1b\[[0-9;?]*[A-Za-z]|\r", b"", bytes(out))
+sys.stdout.write(out.decode(errors="replace"))
+EOF
+)
+	compare "$LINES interactive lines" "$out"
+else
+	echo "soak interactive lines skipped: no python3"
+fi
+
+exit $failed
@@ -0,0 +1,367 @@
+#!/bin/bash
+# Stress test for the non-recursive parser, executor, printer and freer.
+# Generates scripts with very long &&, || and | chains, deeply nested
+# conditionals and sub-shells, long while-read loops, a batch over a list too
+# big for one argv, a fan-out and pipeline stages that exec in place, and
+# checks that ./lsh runs them; and checks launch attributes, time, memo,
+# lsh -j, the bytecode and deadlines.
+# Usage: make test_stress (or N=... DEPTH=... STAGES=... bash test_stress.sh)
+#        PERFRUN is the ./perfrun used to count forks.
+
+N=${N:-100000}
+DEPTH=${DEPTH:-20000}
+STAGES=${STAGES:-500}
+LSH=${LSH:-./lsh}
+PERFRUN=${PERFRUN:-./perfrun}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# repeat TEXT COUNT: TEXT repeated COUNT times, on one line.
+repeat() {
+	yes "$1" | head -n "$2" | tr -d '\n'
+}
+
+# check NAME EXPECTED [lsh args...]: run lsh and compare its output.
+check() {
+	local name=$1 expected=$2
+	shift 2
+	local out
+	out=$("$LSH" "$@" 2>&1)
+	if [ "$out" == "$expected" ]; then
+		echo "stress '$name' ok"
+	else
+		echo "stress '$name' FAILED:"
+		echo "$out" | tail -n 5
+		failed=1
+	fi
+}
+
+# check_status NAME STATUS MIN_MS MAX_MS [lsh args...]: run lsh, and check its exit status and
+# that it took from MIN_MS to MAX_MS milliseconds.
+check_status() {
+	local name=$1 status=$2 min_ms=$3 max_ms=$4
+	shift 4
+	local start rc ms
+	start=$(date +%s%N)
+	"$LSH" "$@" > /dev/null 2>&1
+	rc=$?
+	ms=$((($(date +%s%N) - start) / 1000000))
+	if [ "$rc" -eq "$status" ] && [ "$ms" -ge "$min_ms" ] && [ "$ms" -le "$max_ms" ]; then
+		echo "stress '$name' ok"
+	else
+		echo "stress '$name' FAILED: status $rc after ${ms}ms"
+		failed=1
+	fi
+}
+
+{ repeat 'cd . && ' "$N"; echo 'echo and chain'; } > "$tmp/and.sh"
+check "$N-term && chain" "and chain" "$tmp/and.sh"
+
+{ repeat 'cd . || ' "$N"; echo 'echo bad'; echo 'echo or chain'; } > "$tmp/or.sh"
+check "$N-term || chain" "or chain" "$tmp/or.sh"
+
+# Too many stages to run, but it is parsed and freed.
+{ echo 'if false ; then'; echo -n 'echo x'; repeat ' | cat' "$N"; echo; echo 'fi'; echo 'echo pipe chain'; } > "$tmp/pipe_parse.sh"
+check "$N-term | chain (parse and free)" "pipe chain" "$tmp/pipe_parse.sh"
+
+{ echo -n 'echo pipe stages'; repeat ' | cat' "$STAGES"; echo; } > "$tmp/pipe_run.sh"
+check "$STAGES-stage pipeline" "pipe stages" "$tmp/pipe_run.sh"
+
+{ repeat 'if cd . ; then ' "$DEPTH"; echo -n 'echo nested if'; repeat ' ; fi' "$DEPTH"; echo; } > "$tmp/if.sh"
+check "$DEPTH-deep if" "nested if" "$tmp/if.sh"
+
+{ repeat '( ' "$DEPTH"; echo -n 'echo nested subshell'; repeat ' )' "$DEPTH"; echo; } > "$tmp/paren.sh"
+check "$DEPTH-deep sub-shell" "nested subshell" "$tmp/paren.sh"
+
+{ repeat 'for x in a ; do ' "$DEPTH"; echo -n 'echo nested for $x'; repeat ' ; done' "$DEPTH"; echo; } > "$tmp/for.sh"
+check "$DEPTH-deep for" "nested for a" "$tmp/for.sh"
+
+# 'read' takes lines out of a block buffer; memory doesn't grow with the input.
+echo "seq $N | while read x ; do echo line \$x ; done | tail -n 1" > "$tmp/while.sh"
+check "$N-line while read" "line $N" "$tmp/while.sh"
+
+# A while loop as the last stage runs in the shell, after a command or a thread builtin alike.
+{ echo "seq $N | while read x ; do last=\$x ; done"; echo 'echo $last'
+  echo "echo a b c | while read x y z ; do last_word=\$z ; done"; echo 'echo $last_word'; } > "$tmp/while_vars.sh"
+check "while read keeps its variables" "$N
+c" "$tmp/while_vars.sh"
+
+{ echo "seq $N | while read x ; do sum=\$((sum + x)) ; done"; echo 'echo $sum'; } > "$tmp/arith.sh"
+check "$N-line \$((...)) sum" "$((N * (N + 1) / 2))" "$tmp/arith.sh"
+
+# Each pipeline stage is expanded once, so a bad expression is reported once.
+echo 'echo $((1 / 0)) | /bin/echo $((2 / 0)) | cat' > "$tmp/arith_stages.sh"
+check "\$((...)) error in pipeline stages" "lsh: \$((1 / 0)): division by 0
+lsh: \$((2 / 0)): division by 0" "$tmp/arith_stages.sh"
+
+# Ranges are generated as the loop goes, not expanded up front.
+{ echo "for i in {1..$N} ; do last=\$i ; done"; echo 'echo $last'; } > "$tmp/range.sh"
+check "$N-value {1..N} range" "$N" "$tmp/range.sh"
+
+# Ten times N values: far more argv than one execve takes.
+echo "batch /bin/echo -- {1..$((N * 10))} | wc -w" > "$tmp/batch.sh"
+check "$((N * 10))-value batch" "$((N * 10))" "$tmp/batch.sh"
+
+# batch -P execs each chunk's command in the child it forks for the chunk: one process a chunk.
+{ echo 'LSH_BATCH_MAX=4096'; echo 'batch -P 4 /bin/echo -- {1..3000}'; } > "$tmp/batch_forks.sh"
+chunks=$("$PERFRUN" -o "$tmp/batch_forks.cost" "$LSH" "$tmp/batch_forks.sh" | wc -l)
+read -r _ forks _ < "$tmp/batch_forks.cost"
+if [ "$chunks" -gt 1 ] && [ "$forks" -eq "$chunks" ]; then
+	echo "stress 'batch -P forks once a chunk' ok"
+else
+	echo "stress 'batch -P forks once a chunk' FAILED: $forks forks for $chunks chunks"
+	failed=1
+fi
+
+# Every branch of a fan-out sees all of the producer's output.
+echo "seq 1 $N |& { wc -l ; tail -n 1 ; sort -rn | head -n 1 } | sort -u" > "$tmp/fanout.sh"
+check "$N-line |& fan-out" "$N" "$tmp/fanout.sh"
+
+# A long chain of commands expanded as they run, each of them checked for being a tail.
+{ repeat 'cd $PWD && ' "$N"; echo 'echo expanded'; } > "$tmp/and_expanded.sh"
+check "$N-term && chain of expanded commands" "expanded" "$tmp/and_expanded.sh"
+
+# A stage's last command replaces the stage's child, after what the stage printed before it.
+echo "( echo first ; /bin/echo second ) | ( cat ; /bin/echo third ) | tr '\n' ," > "$tmp/exec_tail.sh"
+check "exec in place of pipeline stages" "first,second,third," "$tmp/exec_tail.sh"
+
+# Launch attributes are printed back, apply to every later child until reset, and after '--' to
+# that one command only.
+{ echo 'spawnattr nice 5 cpus 0 ionice be:7'; echo 'spawnattr'; echo 'nice'; echo 'spawnattr reset'
+  echo 'spawnattr'; echo 'nice'; echo 'spawnattr nice 3 -- nice'; echo 'nice'; } > "$tmp/spawnattr.sh"
+base=$(nice)
+check "spawnattr print and reset" "cpus 0
+nice 5
+ionice 2:7
+spread 0
+$((base + 5))
+spread 0
+$base
+$((base + 3))
+$base" "$tmp/spawnattr.sh"
+
+# A cgroup's missing ancestors are created, and enable the controllers for the level below; the
+# root, whose subtree_control would affect the whole hierarchy, is left alone. Plain directories
+# have no control files, so every write the shell tries is reported.
+mkdir "$tmp/cgroup"
+: > "$tmp/cgroup/cgroup.subtree_control"
+{ echo "LSH_CGROUP_ROOT=$tmp/cgroup"; echo 'spawnattr cgroup a/b -- /bin/true'
+  echo "/bin/wc -c $tmp/cgroup/cgroup.subtree_control"; } > "$tmp/cgroup.sh"
+check "spawnattr cgroup leaves the root alone" "[lsh_launch.c -> cgroup_write()] writing '+cpu' to $tmp/cgroup/a/cgroup.subtree_control error: 2 (No such file or directory)
+[lsh_launch.c -> cgroup_write()] writing '+memory' to $tmp/cgroup/a/cgroup.subtree_control error: 2 (No such file or directory)
+[lsh_launch.c -> cgroup_write()] writing '0' to $tmp/cgroup/a/b/cgroup.procs error: 2 (No such file or directory)
+0 $tmp/cgroup/cgroup.subtree_control" "$tmp/cgroup.sh"
+
+# cpu.max and memory.max belong to the cgroup, so a scoped spawnattr puts them back after its
+# command, even one that set a limit twice, and as the last statement of the script.
+mkdir -p "$tmp/cglimit/g"
+echo 'max 100000' > "$tmp/cglimit/g/cpu.max"
+echo max > "$tmp/cglimit/g/memory.max"
+: > "$tmp/cglimit/g/cgroup.procs"
+{ echo "LSH_CGROUP_ROOT=$tmp/cglimit"
+  echo "spawnattr cgroup g cpu.max 1000/100000 cpu.max 2000/100000 memory.max 1048576 -- /bin/grep -h . $tmp/cglimit/g/cpu.max $tmp/cglimit/g/memory.max"
+  echo "/bin/grep -h . $tmp/cglimit/g/cpu.max $tmp/cglimit/g/memory.max"
+  echo "spawnattr cgroup g memory.max 2097152 -- /bin/true"; } > "$tmp/cglimit.sh"
+check "spawnattr puts cgroup limits back" "2000 100000
+1048576
+max 100000
+max" "$tmp/cglimit.sh"
+if [ "$(cat "$tmp/cglimit/g/memory.max")" != max ]; then
+	echo "stress 'spawnattr puts cgroup limits back' FAILED: memory.max left at $(cat "$tmp/cglimit/g/memory.max")"
+	failed=1
+fi
+
+# time reports by TIMEFORMAT, dropping digits past the precision as bash does; an empty one turns
+# the report off, and LSH_TIME_LOG gets a record per timed statement whatever TIMEFORMAT is.
+cat > "$tmp/time.sh" << EOF
+TIMEFORMAT='%%|%0R|%0lR'
+time /bin/sleep 0.6
+TIMEFORMAT=
+time /bin/true
+LSH_TIME_LOG=$tmp/time.log
+time /bin/false
+time seq 3 | wc -l
+grep -c rc...1, $tmp/time.log
+grep -c cmd....seq.3 $tmp/time.log
+EOF
+check "time, TIMEFORMAT and LSH_TIME_LOG" "%|0|0m0s
+3
+1
+1" "$tmp/time.sh"
+
+# memo runs a command once per key: its argv, and the size and mtime of each --dep file. Each run
+# is logged, and prints 1000 bytes, so that LSH_MEMO_MAX=2500 holds two entries and the least
+# recently used is evicted for a third. Recency is an entry's mtime, which the kernel keeps to
+# a clock tick, so the steps that order the entries are spaced out.
+{ echo "echo \$1 >> $tmp/memo_runs"; echo 'yes $1 | head -n 500'; } > "$tmp/memo_cmd.sh"
+echo "echo changed >> $tmp/memo_dep" > "$tmp/memo_touch.sh"
+touch "$tmp/memo_dep"
+cat > "$tmp/memo.sh" << EOF
+LSH_MEMO_DIR=$tmp/memo
+memo -- /bin/sh $tmp/memo_cmd.sh a | uniq
+memo -- /bin/sh $tmp/memo_cmd.sh a | uniq
+memo -- /bin/sh $tmp/memo_cmd.sh b | uniq
+/bin/sleep 0.05
+memo -- /bin/sh $tmp/memo_cmd.sh a | uniq
+LSH_MEMO_MAX=2500
+/bin/sleep 0.05
+memo -- /bin/sh $tmp/memo_cmd.sh c | uniq
+/bin/sleep 0.05
+memo -- /bin/sh $tmp/memo_cmd.sh a | uniq
+/bin/sleep 0.05
+memo -- /bin/sh $tmp/memo_cmd.sh b | uniq
+/bin/sleep 0.05
+memo --dep $tmp/memo_dep -- /bin/sh $tmp/memo_cmd.sh d | uniq
+memo --dep $tmp/memo_dep -- /bin/sh $tmp/memo_cmd.sh d | uniq
+/bin/sh $tmp/memo_touch.sh
+memo --dep $tmp/memo_dep -- /bin/sh $tmp/memo_cmd.sh d | uniq
+memo --clear
+memo --dep $tmp/memo_dep -- /bin/sh $tmp/memo_cmd.sh d | uniq
+memo -- /bin/false || echo failed
+memo -- /bin/false || echo failed again
+memo --dep || echo no dep file
+memo --env || echo no env name
+cat $tmp/memo_runs
+EOF
+check "memo hits, misses, evictions and deps" "a
+a
+b
+a
+c
+a
+b
+d
+d
+d
+d
+failed
+failed again
+usage: memo [--dep FILE]... [--env NAME]... [--clear] [--] command args...
+no dep file
+usage: memo [--dep FILE]... [--env NAME]... [--clear] [--] command args...
+no env name
+a
+b
+c
+b
+d
+d
+d" "$tmp/memo.sh"
+
+# lsh -j N runs scripts in parallel, each with its own variables. The return codes are reported
+# in argument order however the scripts finish, and the shell exits with the first non-zero one.
+echo 'exit $1' > "$tmp/exit.sh"
+{ echo 'x=one'; echo '/bin/sleep 0.3'; echo 'echo $x'; echo '/bin/sh' "$tmp/exit.sh" 0; } > "$tmp/job1.sh"
+{ echo 'echo two $x'; echo '/bin/sleep 0.3'; echo '/bin/sh' "$tmp/exit.sh" 3; } > "$tmp/job2.sh"
+{ echo '/bin/sleep 0.3'; echo '/bin/sh' "$tmp/exit.sh" 4; } > "$tmp/job3.sh"
+echo 'done' > "$tmp/job4.sh"
+check "lsh -j 1 keeps each script's output in order" "one
+two
+$tmp/job1.sh: exit 0
+$tmp/job2.sh: exit 3
+$tmp/job3.sh: exit 4" -j 1 "$tmp/job1.sh" "$tmp/job2.sh" "$tmp/job3.sh"
+check "lsh -j 3 reports in argument order" "syntax error, unexpected DONE at line 1
+one
+$tmp/job4.sh: parse error
+$tmp/job3.sh: exit 4
+$tmp/job1.sh: exit 0" -j 3 "$tmp/job4.sh" "$tmp/job3.sh" "$tmp/job1.sh"
+check_status "lsh -j 3 exits with the first failure" 3 250 850 -j 3 "$tmp/job1.sh" "$tmp/job2.sh" "$tmp/job3.sh"
+
+# Loops, conditionals, chains and sub-shells run from the bytecode as the tree-walking executor
+# ran them, which for these is as bash runs them, also where a loop runs a node's code again (a
+# pipeline stage, a background statement); and --print_bytecode lists the instructions.
+cat > "$tmp/control.sh" << 'EOF'
+for i in 1 2 3 ; do for j in a b ; do if /bin/test $i -eq 2 ; then echo skip $i $j ; else echo run $i $j ; fi ; done ; done
+n=0
+for x in {1..5} ; do n=$((n + x)) ; done
+echo sum $n
+while /bin/test $n -gt 4 ; do n=$((n - 4)) ; echo down $n ; done
+/bin/false && echo not reached
+/bin/false || echo or taken
+/bin/true && echo and taken
+( cd / && echo in sub ) && echo after sub
+if /bin/false ; then echo no ; else if /bin/true ; then echo nested else ; fi ; fi
+for w in {3..1} ; do echo count $w ; done
+for i in 1 2 3 ; do /bin/echo pipe $i | /bin/cat && echo chained $i ; done
+for i in 1 2 ; do /bin/echo bg $i &
+wait ; done
+for i in 1 2 ; do echo $i | ( if /bin/true ; then /bin/cat ; fi ) ; done
+EOF
+check "bytecode control flow matches bash" "$(bash "$tmp/control.sh" 2>&1)" "$tmp/control.sh"
+{ echo 'for i in a b ; do /bin/echo $i ; done'; echo 'cd . && echo yes'; echo '/bin/false || echo no'; } > "$tmp/bytecode.sh"
+check "--print_bytecode" "bytecode: 15 instructions, 1 loop slots, 0 time slots
+0000  STATEMENT
+0001  FOR_BEGIN     slot 0 i in a b
+0002  FOR_NEXT      slot 0, done -> 0006
+0003  STATEMENT
+0004  SIMPLE        /bin/echo \$i
+0005  JUMP          -> 0002
+0006  STATEMENT
+0007  BUILTIN       cd .
+0008  JUMP_IF_FAIL  -> 0010
+0009  BUILTIN       echo yes
+0010  STATEMENT
+0011  SIMPLE        /bin/false
+0012  JUMP_IF_OK    -> 0014
+0013  BUILTIN       echo no
+0014  HALT
+a
+b
+yes
+no" --print_bytecode "$tmp/bytecode.sh"
+
+# Deadlines: an expired one returns 124, and a command that ignores SIGTERM is killed once the
+# grace period is over. LSH_CMD_TIMEOUT bounds every child the shell waits for: pipeline stages,
+# pdo workers, fan-out branches and background jobs, even those that never exec anything.
+echo 'timeout 200ms /bin/sleep 5' > "$tmp/timeout.sh"
+check_status "timeout returns 124" 124 150 2000 "$tmp/timeout.sh"
+echo 'timeout 0.0001 /bin/sleep 5' > "$tmp/timeout_tiny.sh"
+check_status "sub-millisecond timeout still expires" 124 0 1500 "$tmp/timeout_tiny.sh"
+{ echo "trap '' TERM"; echo 'exec sleep 5'; } > "$tmp/stubborn.sh"
+echo "timeout -k 300ms 200ms /bin/sh $tmp/stubborn.sh" > "$tmp/timeout_kill.sh"
+check_status "timeout SIGKILLs after the grace period" 124 450 2500 "$tmp/timeout_kill.sh"
+cat > "$tmp/deadlines.sh" << 'EOF'
+LSH_CMD_TIMEOUT=300ms
+LSH_KILL_GRACE=100ms
+( while /bin/true ; do cd . ; done ) | /bin/true
+/bin/echo pipeline
+for i in 1 2 ; pdo while /bin/true ; do cd . ; done ; done
+/bin/echo pdo
+seq 3 |& { ( while /bin/true ; do cd . ; done ) ; wc -l }
+( while /bin/true ; do cd . ; done ) &
+wait
+/bin/echo wait
+EOF
+check "LSH_CMD_TIMEOUT bounds every child" "pipeline
+pdo
+3
+wait" "$tmp/deadlines.sh"
+
+# A deadline signals the command's process group, so what the command forked goes too: here the
+# inner sh would otherwise outlive the outer one and leave the flag. (Run away from a terminal,
+# where the command stays in the shell's group.) A background job's deadline runs from when it
+# starts, not from 'wait': the job is killed while the shell waits for the foreground sleep.
+echo "/bin/sh -c '/bin/sleep 1; : > $tmp/grandchild.flag'" > "$tmp/grandchild.sh"
+echo "timeout 200ms /bin/sh $tmp/grandchild.sh" > "$tmp/timeout_group.sh"
+check_status "timeout kills the command's process group" 124 150 1500 "$tmp/timeout_group.sh" < /dev/null
+sleep 1.2
+if [ -e "$tmp/grandchild.flag" ]; then
+	echo "stress 'timeout kills the command's process group' FAILED: the grandchild survived"
+	failed=1
+fi
+{ echo 'LSH_CMD_TIMEOUT=1s'; echo '/bin/sleep 10 &'; echo 'timeout 5 /bin/sleep 1.5'; echo 'wait'; } > "$tmp/bg_deadline.sh"
+check_status "a background job's deadline runs from its start" 0 1400 2200 "$tmp/bg_deadline.sh"
+
+# Printing a chain indents each level, so keep this one small.
+{ repeat 'cd . && ' 2000; echo 'echo printed'; } > "$tmp/print.sh"
+lines=$("$LSH" --print_ast_only "$tmp/print.sh" | wc -l)
+if [ "$lines" -eq 4002 ]; then
+	echo "stress 'print 2001-term && chain' ok"
+else
+	echo "stress 'print 2001-term && chain' FAILED: $lines lines"
+	failed=1
+fi
+
+exit $failed